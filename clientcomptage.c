@@ -14,15 +14,37 @@
 #include "common/string.h"
 
 #include <err.h>
+#include <limits.h>
 #include <math.h>
+#include <errno.h>
+#include <float.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/signal.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "postgres_fe.h"
 #include "common/username.h"
@@ -34,9 +56,12 @@
 #include "fe_utils/simple_list.h"
 #include "fe_utils/string_utils.h"
 
+#include "catalog/pg_type_d.h"
 #include "fe_utils/print.h"
 #include "libpq-fe.h"
 #include "libpq/pqsignal.h"
+#include "port/pg_bswap.h"
+#include "pqexpbuffer.h"
 
 
 /*
@@ -45,6 +70,44 @@
 #define CLIENTCOMPTAGE_VERSION "0.0.1"
 #define CLIENTCOMPTAGE_DEFAULT_LINES 20
 #define CLIENTCOMPTAGE_DEFAULT_STRING_SIZE 2048
+#define CLIENTCOMPTAGE_KEY_SIZE 16
+#define CLIENTCOMPTAGE_MAX_RETRIES 6
+#define CLIENTCOMPTAGE_RETRY_BASE_DELAY 100000
+#define CLIENTCOMPTAGE_RETRY_MAX_DELAY 10000000
+#define CLIENTCOMPTAGE_EVENT_SIZE 64
+#define CLIENTCOMPTAGE_RING_SIZE 65536
+#define CLIENTCOMPTAGE_DEFAULT_BATCH_SIZE 5000
+#define CLIENTCOMPTAGE_DEFAULT_BATCH_DELAY 200
+#define CLIENTCOMPTAGE_DEFAULT_JOBS 1
+#define CLIENTCOMPTAGE_MAX_JOBS 64
+#define CLIENTCOMPTAGE_COPY_CHUNK_SIZE (1024 * 1024)
+#define USECS_PER_SEC INT64CONST(1000000)
+#define SECS_PER_HOUR 3600
+#define SECS_PER_DAY 86400
+#define USECS_PER_DAY (INT64CONST(86400) * USECS_PER_SEC)
+#define POSTGRES_EPOCH_DAYS 10957
+#define POSTGRES_EPOCH_USECS (POSTGRES_EPOCH_DAYS * USECS_PER_DAY)
+#define CLIENTCOMPTAGE_LOCAL_FILE ".clientcomptage.col"
+#define CLIENTCOMPTAGE_LOCAL_MAGIC "CCOL"
+#define CLIENTCOMPTAGE_LOCAL_VERSION 3
+#define CLIENTCOMPTAGE_CALENDAR_WORDS 6
+#define CLIENTCOMPTAGE_SLOT_NAME "clientcomptage"
+#define CLIENTCOMPTAGE_STATUS_INTERVAL 10
+#define CLIENTCOMPTAGE_PENDING_RETRY 10
+#define CLIENTCOMPTAGE_QUEUE_SIZE 1024
+#define CLIENTCOMPTAGE_SPIN_LIMIT 64
+#define CLIENTCOMPTAGE_OUTPUT_BUFFER_SIZE (64 * 1024)
+#define CLIENTCOMPTAGE_MAX_IOV 64
+#define CLIENTCOMPTAGE_DEFAULT_SAMPLE_ROWS 100
+#define CLIENTCOMPTAGE_EXPORT_CHUNKS 8
+#define CLIENTCOMPTAGE_EXPORT_ALIGN 4096
+#define CLIENTCOMPTAGE_ARENA_BLOCK_SIZE (8 * 1024)
+#define CLIENTCOMPTAGE_MEM_BUCKETS 32
+#define CLIENTCOMPTAGE_CHUNK_ROWS 1024
+#define CLIENTCOMPTAGE_TDIGEST_COMPRESSION 100
+#define CLIENTCOMPTAGE_TDIGEST_CAPACITY 500
+#define ZIGZAG(v) (((uint64) (v) << 1) ^ (uint64) ((v) >> 63))
+#define UNZIGZAG(v) ((int64) ((v) >> 1) ^ -(int64) ((v) & 1))
 
 
 /*
@@ -57,9 +120,50 @@ typedef enum
   AJOUT,
   JOURS,
   MOIS,
-  SEMAINES
+  SEMAINES,
+  DAEMON,
+  IMPORT,
+  SYNC,
+  FOLLOW,
+  EXPORT,
+  BUCKET,
+  ROLLING,
+  OVERLAPS,
+  INSTALL,
+  CALENDAR,
+  STATS,
+  HEATMAP,
+  COMPARE
 } actions_t;
 
+typedef enum
+{
+  FORMAT_ALIGNED = 0,
+  FORMAT_UNALIGNED,
+  FORMAT_CSV,
+  FORMAT_TSV,
+  FORMAT_NDJSON,
+  FORMAT_STREAMED
+} formats_t;
+
+/* phases of the run, for the allocation statistics */
+typedef enum
+{
+  PHASE_PARSE = 0,
+  PHASE_CONNECT,
+  PHASE_QUERY,
+  PHASE_PRINT,
+  PHASE_COUNT
+} phases_t;
+
+/* outcome of sending a daemon batch */
+typedef enum
+{
+  BATCH_SENT = 0,
+  BATCH_REJECTED,
+  BATCH_NOT_SENT
+} batch_status_t;
+
 /* these are the options structure for command line parameters */
 struct options
 {
@@ -68,6 +172,51 @@ struct options
   bool      verbose;
   actions_t action;
   char      *heures;
+  formats_t format;
+  int       sample_rows;
+  bool      server_widths;
+  int       max_memory;
+
+  /* daemon mode */
+  char      *socket_path;
+  char      *pending_file;
+  char      *rejected_file;
+  int       batch_size;
+  int       batch_delay;
+
+  /* import */
+  char      *import_file;
+  int       jobs;
+
+  /* local replica */
+  char      *local_file;
+  bool      offline;
+
+  /* time-bucket reports */
+  char      *bucket;
+  char      *from;
+  char      *to;
+  char      *tz;
+  int       last;
+
+  /* overlapping entries */
+  bool      fix;
+  bool      exclude_overlaps;
+
+  /* calendar */
+  char      *calendar;
+
+  /* duration statistics */
+  char      *stats;
+  bool      sketch;
+
+  /* period comparison */
+  char      *compare;
+
+  /* export */
+  char      *export_file;
+  bool      export_binary;
+  bool      compress;
 
   /* connection parameters */
   char      *dsn;
@@ -78,12 +227,281 @@ struct options
 };
 
 
+/*
+ * Features of the connected server, and of libpq, that may be relied on
+ */
+typedef struct
+{
+  bool range_offset;       /* 11: RANGE offset PRECEDING in windows */
+  bool generated_columns;  /* 12: stored generated columns */
+  bool pipeline;           /* 14: pipeline mode, libpq 14 too */
+  bool date_bin;           /* 14: date_bin() */
+  bool merge;              /* 15: MERGE */
+  bool chunked_rows;       /* 17: chunked rows mode, libpq 17 too */
+} server_caps;
+
+
+/*
+ * Allocation counters of one phase
+ *
+ * histogram[k] counts the allocations of at most 2^k bytes, and more
+ * than 2^(k-1). Results are the libpq results received.
+ */
+typedef struct
+{
+  atomic_llong allocs;
+  atomic_llong bytes;
+  atomic_llong results;
+  atomic_llong result_bytes;
+  atomic_llong histogram[CLIENTCOMPTAGE_MEM_BUCKETS];
+} mem_counters;
+
+
+/*
+ * Bump allocator
+ *
+ * Memory is carved out of large blocks and given back all at once by
+ * arena_reset(), which keeps the blocks for the next request.
+ */
+typedef struct arena_block
+{
+  struct arena_block *next;
+  size_t             size;
+  size_t             used;
+  char               data[FLEXIBLE_ARRAY_MEMBER];
+} arena_block;
+
+typedef struct
+{
+  arena_block *first;
+  arena_block *last;
+  arena_block *current;
+  size_t      block_size;
+  size_t      used;
+  size_t      peak;
+  int64       allocs;
+  int64       blocks;
+  int64       resets;
+} arena;
+
+
+/*
+ * Lock-free multi-producer single-consumer ring of events
+ *
+ * Each slot carries a sequence number telling whether it is free for the
+ * producer claiming position pos (sequence == pos), or filled and ready
+ * for the consumer (sequence == pos + 1).
+ */
+typedef struct
+{
+  atomic_size_t sequence;
+  char          data[CLIENTCOMPTAGE_EVENT_SIZE];
+} ring_slot;
+
+typedef struct
+{
+  ring_slot       *slots;
+  size_t          mask;
+  atomic_size_t   head;
+  size_t          tail;
+
+  /* producers sleeping on a full ring */
+  atomic_int      sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} event_ring;
+
+/* A client of the daemon socket, joined by the main thread */
+typedef struct
+{
+  pthread_t   thread;
+  int         fd;
+  atomic_bool done;
+} daemon_client;
+
+
+/*
+ * One worker of a parallel import, loading a slice of the input file
+ */
+typedef struct
+{
+  int           id;
+  PGconn        *conn;
+  const char    *table;
+  const char    *start;
+  size_t        len;
+  atomic_size_t sent;
+  atomic_bool   done;
+  long          rows;
+  long          rejected;
+  double        elapsed;
+  bool          failed;
+} import_worker;
+
+
+/*
+ * Header of the local replica file
+ *
+ * It is followed by two streams of zigzag varints: the deltas between
+ * consecutive deb, sorted, and the durations (fin - deb). Times are in
+ * microseconds since the Unix epoch. lsn is the end of the last
+ * replicated transaction applied to the file.
+ *
+ * Then comes the calendar: CLIENTCOMPTAGE_CALENDAR_WORDS words per year
+ * from first_year, bit n of a year being set when its day n, counted
+ * from 0, holds an entry, in local time.
+ */
+typedef struct
+{
+  char   magic[4];
+  uint32 version;
+  int64  nrows;
+  int64  watermark;
+  int64  lsn;
+  int64  deb_bytes;
+  int64  duration_bytes;
+  int32  first_year;
+  int32  nyears;
+  char   timezone[64];
+} local_header;
+
+/*
+ * Lock-free single-producer single-consumer bounded queue
+ *
+ * head is only written by the producer and tail by the consumer. Both
+ * spin, yielding the CPU, when the queue is full or empty, then sleep on
+ * the condition variable after CLIENTCOMPTAGE_SPIN_LIMIT tries. The
+ * other side only takes the lock when someone sleeps.
+ */
+typedef struct
+{
+  void            **items;
+  size_t          mask;
+  atomic_size_t   head;
+  atomic_size_t   tail;
+  atomic_int      sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} spsc_queue;
+
+/* Stages of the report pipeline, and the queues between them */
+typedef struct
+{
+  spsc_queue  rows;
+  spsc_queue  buffers;
+  char        *title;
+  formats_t   format;
+
+  /* like printTable: no blanks after the title, a blank line at the end */
+  bool        aligned;
+
+  /* streamed aligned format: column widths, sampled rows, cell buffer */
+  int         *widths;
+  PGresult    **sample;
+  int         nsample;
+  PQExpBuffer cell;
+} report_pipeline;
+
+/*
+ * Export pipeline: COPY data is gathered in large aligned chunks, then
+ * written, compressed or not, by a separate thread
+ */
+typedef struct
+{
+  char   *data;
+  size_t len;
+} export_chunk;
+
+typedef struct
+{
+  spsc_queue full;
+  spsc_queue free;
+  int        fd;
+  int64      written;
+} export_pipeline;
+
+/* Totals per local day, in days since the Unix epoch */
+typedef struct
+{
+  int64 first;
+  int64 ndays;
+  int64 *totals;
+} day_buckets;
+
+/* Local replica, decoded in memory as columns */
+typedef struct
+{
+  int64 nrows;
+  int64 capacity;
+  int64 *deb;
+  int64 *fin;
+  int64 watermark;
+  int64 lsn;
+  char  timezone[64];
+
+  /* days with an entry, rebuilt on save when rows were removed */
+  int32  first_year;
+  int32  nyears;
+  uint64 *calendar;
+  bool   calendar_dirty;
+} local_store;
+
+/*
+ * Merging t-digest of durations, in microseconds
+ *
+ * The first nmerged centroids are sorted and compressed, the others are
+ * buffered until the array is full. Two digests merge by adding the
+ * centroids of one to the other.
+ */
+typedef struct
+{
+  double mean;
+  double weight;
+} centroid;
+
+typedef struct
+{
+  int64    count;
+  double   min;
+  double   max;
+  double   sum;
+  int      nmerged;
+  int      ncentroids;
+  centroid centroids[CLIENTCOMPTAGE_TDIGEST_CAPACITY];
+} tdigest;
+
+/* Statistics of the durations of one period */
+typedef struct
+{
+  int64  key;
+  int64  count;
+  double min;
+  double max;
+  double mean;
+  double p50;
+  double p90;
+  double p99;
+} period_stats;
+
+
 /*
  * Global variables
  */
 PGconn         *conn;
 struct options *opts;
+server_caps    caps;
+arena          opts_arena;
+arena          query_arena;
+bool           mem_stats_enabled;
+atomic_int     mem_phase;
+mem_counters   mem_stats[PHASE_COUNT];
+atomic_llong   mem_live;
+atomic_llong   mem_peak;
+const char     *(*find_delimiter) (const char *p, const char *end);
 extern char    *optarg;
+event_ring     ring;
+atomic_bool    daemon_stop;
+atomic_bool    writer_stop;
 
 
 /*
@@ -95,10 +513,165 @@ void        get_opts(int, char **);
 void        *pg_malloc(size_t size);
 char        *pg_strdup(const char *in);
 #endif
-void        fetch_table(char *label, char *query);
+static void mem_count(size_t size, size_t usable);
+void        *mem_malloc(size_t size);
+void        *mem_malloc0(size_t size);
+void        *mem_realloc(void *ptr, size_t size);
+char        *mem_strdup(const char *in);
+void        mem_free(void *ptr);
+void        mem_result(const PGresult *res);
+void        mem_report(void);
+void        arena_init(arena *a, size_t block_size);
+void        *arena_alloc(arena *a, size_t size);
+char        *arena_strdup(arena *a, const char *in);
+char        *arena_psprintf(arena *a, const char *fmt,...) pg_attribute_printf(2, 3);
+void        arena_reset(arena *a);
+void        arena_free(arena *a);
+static void arena_report(const char *name, const arena *a);
+static PQExpBuffer scratch_buffer(void);
+static void init_print_options(printQueryOpt *myopt, char *label);
+void        fetch_table(char *label, const char *query, int nparams,
+                        const char *const *values);
+void        bucket_report(const char *view);
 bool        backend_minimum_version(int major, int minor);
+void        set_capabilities(void);
+void        generate_entry_key(char *key);
+static void retry_delay(int attempt);
+PGresult    *run_query(const char *query, int nparams,
+                       const char *const *values, int format);
+PGresult    *run_query_once(const char *query, int nparams,
+                            const char *const *values, int format);
+void        set_local_timezone(void);
+static void civil_from_days(int64 days, int *y, int *m, int *d);
+static void append_timestamp(PQExpBuffer out, int64 usecs, bool with_zone);
+static void append_interval(PQExpBuffer out, int64 time, int32 days,
+                            int32 months);
+static char *format_interval(int64 time, int32 days, int32 months);
+static void append_numeric(PQExpBuffer out, const char *v);
+void        append_binary_value(PQExpBuffer out, const char *v, int len,
+                                Oid type);
+char        *format_binary_value(const char *v, int len, Oid type);
+static void append_csv(PQExpBuffer out, const char *v, int len);
+static void append_tsv(PQExpBuffer out, const char *v, int len);
+static void append_json_string(PQExpBuffer out, const char *v, int len);
+void        print_binary_result(const PGresult *res, const printQueryOpt *opt);
+void        spsc_init(spsc_queue *q, size_t size);
+void        spsc_destroy(spsc_queue *q);
+static void spsc_wake(spsc_queue *q);
+void        spsc_push(spsc_queue *q, void *item);
+void        *spsc_pop(spsc_queue *q);
+static int  display_width(const char *s, int len);
+static void append_rule(PQExpBuffer out, const report_pipeline *pl,
+                        int nfields);
+static void append_padded(PQExpBuffer out, const char *v, int len,
+                          int width, char align);
+static void sample_widths(report_pipeline *pl, const PGresult *row);
+static void format_header(PQExpBuffer out, report_pipeline *pl,
+                          const PGresult *row);
+static void format_row(PQExpBuffer out, report_pipeline *pl,
+                       const PGresult *row, int tuple);
+static bool is_row_result(const PGresult *res);
+static void *pipeline_formatter(void *arg);
+static void *pipeline_writer(void *arg);
+static int  *server_widths(const char *query, int nparams,
+                          const char *const *values);
+void        stream_table(char *label, const char *query, int nparams,
+                         const char *const *values);
+static void update_widths(report_pipeline *pl, const PGresult *row);
+static void spill_row(FILE *spill, const PGresult *row);
+static PGresult *unspill_row(FILE *spill, const PGresult *attrs,
+                             PQExpBuffer data);
+void        spill_table(char *label, const char *query, int nparams,
+                        const char *const *values);
 void        execute(char *query);
+void        execute_once(char *query);
 void        exec_command(char *cmd);
+static const char *find_delimiter_scalar(const char *p, const char *end);
+#if defined(__x86_64__)
+static const char *find_delimiter_sse2(const char *p, const char *end);
+static const char *find_delimiter_avx2(const char *p, const char *end);
+#endif
+void        init_parser(void);
+static int64 days_from_civil(int y, int m, int d);
+static int  days_in_month(int y, int m);
+static int64 local_offset(int64 local_secs);
+static int64 utc_offset(int64 utc_secs);
+bool        parse_timestamp(const char *p, const char *end, int64 *result);
+bool        parse_row(const char *p, const char *end, int64 *deb, int64 *fin);
+void        ring_init(event_ring *r, size_t size);
+void        ring_push_wait(event_ring *r, const char *event, size_t len);
+void        ring_wake(event_ring *r);
+bool        ring_push(event_ring *r, const char *event, size_t len);
+bool        ring_pop(event_ring *r, char *event);
+static void *daemon_reader(void *arg);
+static void *daemon_writer(void *arg);
+static batch_status_t flush_batch(PQExpBuffer batch);
+static bool write_events(const char *path, PQExpBuffer events);
+static bool spill_batch(PQExpBuffer batch);
+static bool send_batch(PQExpBuffer batch);
+static bool flush_pending(void);
+void        run_daemon(void);
+static double elapsed_since(const struct timespec *start);
+static void *import_chunk(void *arg);
+void        run_import(const ConnParams *cparams, const char *progname);
+static uint8 *encode_varint(uint8 *p, uint64 v);
+static const uint8 *decode_varint(const uint8 *p, const uint8 *end, uint64 *v);
+void        local_store_load(local_store *st);
+void        local_store_save(local_store *st);
+void        local_store_append(local_store *st, int64 deb, int64 fin);
+static int64 local_store_find(const local_store *st, int64 deb, int64 fin);
+static void local_store_remove(local_store *st, int64 row);
+static void sync_rows(local_store *st, int64 watermark);
+static bool sync_checksum_matches(const local_store *st);
+void        run_sync(void);
+static int64 now_pg_usecs(void);
+static void send_feedback(PGconn *rconn, int64 lsn);
+static const char *read_tuple(const char *p, int deb_col, int fin_col,
+                              int64 *deb, int64 *fin);
+void        run_follow(const ConnParams *cparams);
+static void write_all(int fd, const char *buf, size_t len);
+static void *export_writer(void *arg);
+void        run_export(void);
+static char *format_date(int64 days);
+static inline int64 local_day(int64 usecs);
+void        aggregate_days(const int64 *deb, const int64 *fin, int64 n,
+                           day_buckets *b);
+int64       rollup_days(const day_buckets *b, actions_t granularity,
+                        int64 *keys, int64 *sums);
+void        local_report(actions_t action);
+void        rolling_sums(const int64 *totals, int64 n, int width, int64 *sums);
+static void print_rolling(const day_buckets *b, const bool *visible);
+void        rolling_report(void);
+static char *format_timestamp(int64 usecs);
+void        merge_overlaps(void);
+void        install_schema(void);
+static void calendar_set(local_store *st, int64 day);
+static void calendar_mark(local_store *st, int64 deb, int64 fin);
+static void calendar_rebuild(local_store *st);
+static bool calendar_test(const local_store *st, int64 day);
+static int  calendar_count(const local_store *st, int64 from, int64 to);
+static bool parse_date(const char *s, int64 *day);
+void        calendar_report(local_store *st);
+void        tdigest_init(tdigest *td);
+static void tdigest_add_centroid(tdigest *td, double mean, double weight);
+void        tdigest_add(tdigest *td, double value);
+void        tdigest_merge(tdigest *dst, const tdigest *src);
+static int  centroid_cmp(const void *a, const void *b);
+static void tdigest_compress(tdigest *td);
+double      tdigest_quantile(tdigest *td, double q);
+static void close_period(tdigest *td, tdigest *total, int64 key,
+                         period_stats **periods, int64 *nperiods,
+                         int64 *capacity);
+static void print_stats(const period_stats *periods, int64 nperiods,
+                        bool total);
+static void stats_from_store(const local_store *st, bool monthly);
+void        stats_report(void);
+void        heatmap_add(int64 deb, int64 fin, int64 cells[7][24]);
+static void print_heatmap(int64 cells[7][24]);
+void        heatmap_report(void);
+void        compare_report(void);
+void        add_entry(char *sql);
+static void stop_daemon(SIGNAL_ARGS);
 static void quit_properly(SIGNAL_ARGS);
 
 
@@ -114,14 +687,62 @@ help(const char *progname)
        "\nGeneral options:\n"
        "  -a            ajout d'heures réalisées\n"
        "  -j|--jour     décompte par jour\n"
-       "  -m|--mois     décompte par mois\n"
-       "  -s|--semaines décompte par semaine\n"
+       "  -m|--mois     décompte par mois (accepte --from, --to, --last)\n"
+       "  -s|--semaines décompte par semaine (accepte --from, --to, --last)\n"
        "  -v            verbose\n"
+       "  --bucket UNIT        décompte par hour, day, week, month, quarter, year\n"
+       "                       ou par intervalle (\"15 minutes\", PostgreSQL 14+)\n"
+       "  --from DATE          début de la période (incluse)\n"
+       "  --to DATE            fin de la période (exclue)\n"
+       "  --last N             les N dernières périodes, en cours comprise\n"
+       "  --tz ZONE            fuseau horaire des périodes (défaut : serveur)\n"
+       "  --rolling            cumuls glissants sur 7 jours et 4 semaines\n"
+       "  --merge-overlaps     liste les pointages qui se chevauchent\n"
+       "  --fix                avec --merge-overlaps, fusionne ces pointages\n"
+       "  --install-schema     installe la clé unique et l'index sur deb\n"
+       "  --exclude-overlaps   avec --install-schema, refuse les chevauchements\n"
+       "  --stats UNIT         min, max, moyenne et percentiles des durées par\n"
+       "                       week ou month (accepte --from, --to, --last)\n"
+       "  --sketch             avec --stats, calcul par le client (t-digest)\n"
+       "  --heatmap            temps travaillé par jour de la semaine et heure\n"
+       "  --compare UNIT       week : semaine en cours et précédente, month : mois\n"
+       "                       en cours et même mois de l'année précédente\n"
+       "  --calendar RAPPORT   depuis la copie locale : days (jours travaillés\n"
+       "                       par mois), gaps (jours ouvrés sans pointage,\n"
+       "                       --from/--to), streaks (jours consécutifs)\n"
+       "  --mem-stats          statistiques d'allocation mémoire par phase (hors\n"
+       "                       allocations internes de libpq et de la libc)\n"
+       "  -F|--format FORMAT   format de sortie : aligned, unaligned, csv, tsv,\n"
+       "                       ndjson, streamed\n"
+       "  --sample-rows N      lignes utilisées pour la largeur des colonnes en\n"
+       "                       format streamed (défaut : %d)\n"
+       "  --server-widths      largeur des colonnes calculée par le serveur\n"
+       "  --max-memory MB      mémoire maximum d'un rapport, le reste passe\n"
+       "                       par un fichier temporaire\n"
+       "\nDaemon options:\n"
+       "  -D|--daemon SOCKET   reçoit les pointages \"deb,fin\" sur un socket Unix\n"
+       "  --batch-size N       nombre de pointages par lot (défaut : %d)\n"
+       "  --batch-delay MS     délai maximum avant envoi d'un lot (défaut : %d)\n"
+       "\nImport options:\n"
+       "  --import FILE        importe un fichier CSV \"deb,fin\"\n"
+       "  --jobs N             nombre de connexions utilisées (défaut : %d)\n"
+       "\nLocal replica options:\n"
+       "  --sync               met à jour la copie locale de comptage\n"
+       "  -o|--offline         calcule -j, -m, -s, --rolling, --stats et --heatmap\n"
+       "                       depuis la copie locale\n"
+       "  --follow             suit les modifications par réplication logique\n"
+       "  --local FILE         fichier de la copie locale (défaut : ~/%s)\n"
+       "\nExport options:\n"
+       "  --export FILE        exporte public.comptage avec COPY\n"
+       "  --export-format FMT  format de l'export : csv, binary (défaut : csv)\n"
+       "  --compress           compresse l'export avec zstd\n"
        "  -?|--help     show this help, then exit\n"
        "  -V|--version  output version information, then exit\n"
        "\n"
        "Report bugs to <guillaume@lelarge.info>.\n",
-       progname, progname);
+       progname, progname, CLIENTCOMPTAGE_DEFAULT_SAMPLE_ROWS,
+       CLIENTCOMPTAGE_DEFAULT_BATCH_SIZE, CLIENTCOMPTAGE_DEFAULT_BATCH_DELAY,
+       CLIENTCOMPTAGE_DEFAULT_JOBS, CLIENTCOMPTAGE_LOCAL_FILE);
 }
 
 
@@ -131,14 +752,81 @@ help(const char *progname)
 void
 get_opts(int argc, char **argv)
 {
+  static struct option long_options[] = {
+    {"jour", no_argument, NULL, 'j'},
+    {"mois", no_argument, NULL, 'm'},
+    {"semaines", no_argument, NULL, 's'},
+    {"daemon", required_argument, NULL, 'D'},
+    {"batch-size", required_argument, NULL, 1},
+    {"batch-delay", required_argument, NULL, 2},
+    {"import", required_argument, NULL, 3},
+    {"jobs", required_argument, NULL, 4},
+    {"sync", no_argument, NULL, 5},
+    {"local", required_argument, NULL, 6},
+    {"follow", no_argument, NULL, 7},
+    {"offline", no_argument, NULL, 'o'},
+    {"format", required_argument, NULL, 'F'},
+    {"sample-rows", required_argument, NULL, 8},
+    {"server-widths", no_argument, NULL, 9},
+    {"export", required_argument, NULL, 10},
+    {"export-format", required_argument, NULL, 11},
+    {"compress", no_argument, NULL, 12},
+    {"mem-stats", no_argument, NULL, 13},
+    {"max-memory", required_argument, NULL, 14},
+    {"bucket", required_argument, NULL, 15},
+    {"from", required_argument, NULL, 16},
+    {"to", required_argument, NULL, 17},
+    {"tz", required_argument, NULL, 18},
+    {"last", required_argument, NULL, 19},
+    {"rolling", no_argument, NULL, 20},
+    {"merge-overlaps", no_argument, NULL, 21},
+    {"fix", no_argument, NULL, 22},
+    {"install-schema", no_argument, NULL, 23},
+    {"exclude-overlaps", no_argument, NULL, 24},
+    {"calendar", required_argument, NULL, 25},
+    {"stats", required_argument, NULL, 26},
+    {"sketch", no_argument, NULL, 27},
+    {"heatmap", no_argument, NULL, 28},
+    {"compare", required_argument, NULL, 29},
+    {NULL, 0, NULL, 0}
+  };
   int        c;
+  int        optindex;
   const char *progname;
+  char       home[MAXPGPATH];
 
   progname = get_progname(argv[0]);
 
   /* set the defaults */
   opts->script = NULL;
   opts->verbose = false;
+  opts->action = NONE;
+  opts->heures = NULL;
+  opts->format = FORMAT_ALIGNED;
+  opts->sample_rows = CLIENTCOMPTAGE_DEFAULT_SAMPLE_ROWS;
+  opts->server_widths = false;
+  opts->max_memory = 0;
+  opts->socket_path = NULL;
+  opts->batch_size = CLIENTCOMPTAGE_DEFAULT_BATCH_SIZE;
+  opts->batch_delay = CLIENTCOMPTAGE_DEFAULT_BATCH_DELAY;
+  opts->import_file = NULL;
+  opts->jobs = CLIENTCOMPTAGE_DEFAULT_JOBS;
+  opts->local_file = NULL;
+  opts->offline = false;
+  opts->bucket = NULL;
+  opts->from = NULL;
+  opts->to = NULL;
+  opts->tz = NULL;
+  opts->last = 0;
+  opts->fix = false;
+  opts->exclude_overlaps = false;
+  opts->calendar = NULL;
+  opts->stats = NULL;
+  opts->sketch = false;
+  opts->compare = NULL;
+  opts->export_file = NULL;
+  opts->export_binary = false;
+  opts->compress = false;
 
   /* we should deal quickly with help and version */
   if (argc > 1)
@@ -156,13 +844,14 @@ get_opts(int argc, char **argv)
   }
 
   /* get options */
-  while ((c = getopt(argc, argv, "a:jmsv")) != -1)
+  while ((c = getopt_long(argc, argv, "a:D:F:jmosv",
+                          long_options, &optindex)) != -1)
   {
     switch (c)
     {
       case 'a':
         opts->action = AJOUT;
-        opts->heures = pg_strdup(optarg);
+        opts->heures = arena_strdup(&opts_arena, optarg);
         break;
       case 'j':
         opts->action = JOURS;
@@ -173,11 +862,240 @@ get_opts(int argc, char **argv)
       case 's':
         opts->action = SEMAINES;
         break;
+      case 'v':
+        opts->verbose = true;
+        break;
+      case 'o':
+        opts->offline = true;
+        break;
+      case 'F':
+        if (strcmp(optarg, "aligned") == 0)
+          opts->format = FORMAT_ALIGNED;
+        else if (strcmp(optarg, "unaligned") == 0)
+          opts->format = FORMAT_UNALIGNED;
+        else if (strcmp(optarg, "csv") == 0)
+          opts->format = FORMAT_CSV;
+        else if (strcmp(optarg, "tsv") == 0)
+          opts->format = FORMAT_TSV;
+        else if (strcmp(optarg, "ndjson") == 0)
+          opts->format = FORMAT_NDJSON;
+        else if (strcmp(optarg, "streamed") == 0)
+          opts->format = FORMAT_STREAMED;
+        else
+        {
+          pg_log_error("unknown output format \"%s\"", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'D':
+        opts->action = DAEMON;
+        opts->socket_path = arena_strdup(&opts_arena, optarg);
+        break;
+      case 1:
+        if (!option_parse_int(optarg, "--batch-size", 1, INT_MAX,
+                              &opts->batch_size))
+          exit(EXIT_FAILURE);
+        break;
+      case 2:
+        if (!option_parse_int(optarg, "--batch-delay", 1, INT_MAX,
+                              &opts->batch_delay))
+          exit(EXIT_FAILURE);
+        break;
+      case 3:
+        opts->action = IMPORT;
+        opts->import_file = arena_strdup(&opts_arena, optarg);
+        break;
+      case 4:
+        if (!option_parse_int(optarg, "--jobs", 1, CLIENTCOMPTAGE_MAX_JOBS,
+                              &opts->jobs))
+          exit(EXIT_FAILURE);
+        break;
+      case 5:
+        opts->action = SYNC;
+        break;
+      case 6:
+        opts->local_file = arena_strdup(&opts_arena, optarg);
+        break;
+      case 7:
+        opts->action = FOLLOW;
+        break;
+      case 8:
+        if (!option_parse_int(optarg, "--sample-rows", 1, INT_MAX,
+                              &opts->sample_rows))
+          exit(EXIT_FAILURE);
+        break;
+      case 9:
+        opts->server_widths = true;
+        break;
+      case 10:
+        opts->action = EXPORT;
+        opts->export_file = arena_strdup(&opts_arena, optarg);
+        break;
+      case 11:
+        if (strcmp(optarg, "csv") == 0)
+          opts->export_binary = false;
+        else if (strcmp(optarg, "binary") == 0)
+          opts->export_binary = true;
+        else
+        {
+          pg_log_error("unknown export format \"%s\"", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 12:
+#ifdef USE_ZSTD
+        opts->compress = true;
+#else
+        pg_log_error("compression is not supported by this build");
+        exit(EXIT_FAILURE);
+#endif
+        break;
+      case 13:
+        /* already enabled by main(), to count the parsing too */
+        mem_stats_enabled = true;
+        break;
+      case 14:
+        if (!option_parse_int(optarg, "--max-memory", 1, INT_MAX / 2,
+                              &opts->max_memory))
+          exit(EXIT_FAILURE);
+        break;
+      case 15:
+        opts->action = BUCKET;
+        opts->bucket = arena_strdup(&opts_arena, optarg);
+        break;
+      case 16:
+        opts->from = arena_strdup(&opts_arena, optarg);
+        break;
+      case 17:
+        opts->to = arena_strdup(&opts_arena, optarg);
+        break;
+      case 18:
+        opts->tz = arena_strdup(&opts_arena, optarg);
+        break;
+      case 19:
+        if (!option_parse_int(optarg, "--last", 1, INT_MAX, &opts->last))
+          exit(EXIT_FAILURE);
+        break;
+      case 20:
+        opts->action = ROLLING;
+        break;
+      case 21:
+        opts->action = OVERLAPS;
+        break;
+      case 22:
+        opts->fix = true;
+        break;
+      case 23:
+        opts->action = INSTALL;
+        break;
+      case 24:
+        opts->exclude_overlaps = true;
+        break;
+      case 25:
+        if (strcmp(optarg, "days") != 0 && strcmp(optarg, "gaps") != 0
+            && strcmp(optarg, "streaks") != 0)
+        {
+          pg_log_error("unknown calendar report \"%s\"", optarg);
+          exit(EXIT_FAILURE);
+        }
+        opts->action = CALENDAR;
+        opts->calendar = arena_strdup(&opts_arena, optarg);
+        break;
+      case 26:
+        if (strcmp(optarg, "week") != 0 && strcmp(optarg, "month") != 0)
+        {
+          pg_log_error("--stats only works with week or month");
+          exit(EXIT_FAILURE);
+        }
+        opts->action = STATS;
+        opts->stats = arena_strdup(&opts_arena, optarg);
+        break;
+      case 27:
+        opts->sketch = true;
+        break;
+      case 28:
+        opts->action = HEATMAP;
+        break;
+      case 29:
+        if (strcmp(optarg, "week") != 0 && strcmp(optarg, "month") != 0)
+        {
+          pg_log_error("--compare only works with week or month");
+          exit(EXIT_FAILURE);
+        }
+        opts->action = COMPARE;
+        opts->compare = arena_strdup(&opts_arena, optarg);
+        break;
       default:
         pg_log_error("Try \"%s --help\" for more information.\n", progname);
         exit(EXIT_FAILURE);
     }
   }
+
+  /* the local replica lives in the home directory by default */
+  if (!opts->local_file)
+  {
+    if (!get_home_path(home))
+    {
+      pg_log_error("could not get home directory path");
+      exit(EXIT_FAILURE);
+    }
+    opts->local_file = arena_psprintf(&opts_arena, "%s/%s", home,
+                                      CLIENTCOMPTAGE_LOCAL_FILE);
+  }
+
+  /* the calendar only lives in the local replica */
+  if (opts->action == CALENDAR)
+    opts->offline = true;
+
+  if (opts->offline
+      && opts->action != CALENDAR && opts->action != JOURS && opts->action != MOIS
+      && opts->action != SEMAINES && opts->action != ROLLING
+      && opts->action != STATS && opts->action != HEATMAP)
+  {
+    pg_log_error("--offline only works with -j, -m, -s, --rolling, --stats and --heatmap");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((opts->from || opts->to || opts->tz || opts->last)
+      && ((opts->action != BUCKET && opts->action != MOIS
+           && opts->action != SEMAINES && opts->action != ROLLING
+           && opts->action != CALENDAR && opts->action != STATS
+           && opts->action != HEATMAP && opts->action != COMPARE)
+          || (opts->offline && opts->action != CALENDAR)))
+  {
+    pg_log_error("--from, --to, --last and --tz only work with --bucket, -m, -s, --rolling, --stats, --heatmap and --compare");
+    exit(EXIT_FAILURE);
+  }
+
+  if (opts->fix && opts->action != OVERLAPS)
+  {
+    pg_log_error("--fix only works with --merge-overlaps");
+    exit(EXIT_FAILURE);
+  }
+
+  if (opts->action == COMPARE && (opts->from || opts->to || opts->last))
+  {
+    pg_log_error("--compare only accepts --tz");
+    exit(EXIT_FAILURE);
+  }
+
+  if (opts->sketch && opts->action != STATS)
+  {
+    pg_log_error("--sketch only works with --stats");
+    exit(EXIT_FAILURE);
+  }
+
+  if (opts->exclude_overlaps && opts->action != INSTALL)
+  {
+    pg_log_error("--exclude-overlaps only works with --install-schema");
+    exit(EXIT_FAILURE);
+  }
+
+  if (opts->from && opts->last)
+  {
+    pg_log_error("--from and --last cannot be used together");
+    exit(EXIT_FAILURE);
+  }
 }
 
 
@@ -228,151 +1146,6392 @@ pg_strdup(const char *in)
 
 
 /*
- * Compare given major and minor numbers to the one of the connected server
+ * Real size of an allocation, as far as the C library lets us know
+ *
+ * Without malloc_usable_size(), frees cannot be counted and the peak is
+ * the sum of all allocations.
  */
-bool
-backend_minimum_version(int major, int minor)
-{
-  return opts->major > major || (opts->major == major && opts->minor >= minor);
-}
+#ifdef __GLIBC__
+#define MEM_USABLE_SIZE(ptr, size) malloc_usable_size(ptr)
+#else
+#define MEM_USABLE_SIZE(ptr, size) (size)
+#endif
 
 
 /*
- * Execute query
+ * Count an allocation in the current phase
  */
-void
-execute(char *query)
+static void
+mem_count(size_t size, size_t usable)
 {
-  PGresult *results;
+  mem_counters *c = &mem_stats[atomic_load_explicit(&mem_phase,
+                                                    memory_order_relaxed)];
+  long long    live;
+  long long    peak;
+  int          bucket;
 
-  if (opts->script)
-  {
-    printf("%s;\n", query);
-  }
-  else
-  {
-    /* make the call */
-    results = PQexec(conn, query);
+  bucket = size <= 1 ? 0 : 64 - __builtin_clzll((unsigned long long) size - 1);
+  bucket = Min(bucket, CLIENTCOMPTAGE_MEM_BUCKETS - 1);
 
-    /* check and deal with errors */
-    if (!results)
-    {
-      pg_log_error("query failed: %s", PQerrorMessage(conn));
-      pg_log_info("query was: %s", query);
-      PQclear(results);
-      PQfinish(conn);
-      exit(EXIT_FAILURE);
-    }
+  atomic_fetch_add_explicit(&c->allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->bytes, size, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->histogram[bucket], 1, memory_order_relaxed);
 
-    /* cleanup */
-    PQclear(results);
-  }
+  live = atomic_fetch_add_explicit(&mem_live, usable,
+                                   memory_order_relaxed) + usable;
+  peak = atomic_load_explicit(&mem_peak, memory_order_relaxed);
+  while (live > peak
+         && !atomic_compare_exchange_weak_explicit(&mem_peak, &peak, live,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed))
+    ;
 }
 
 
 /*
- * Handle query
+ * Counting wrappers around the allocation functions
  */
-void
-fetch_table(char *label, char *query)
+void *
+mem_malloc(size_t size)
 {
-  PGresult      *res;
-  printQueryOpt myopt;
+  void *p = pg_malloc(size);
 
-  if (opts->script)
-  {
-    printf("\\echo %s\n",label);
-    printf("%s;\n",query);
-  }
-  else
-  {
-    myopt.nullPrint = NULL;
-    myopt.title = pstrdup(label);
-    myopt.translate_header = false;
-    myopt.n_translate_columns = 0;
-    myopt.translate_columns = NULL;
-    myopt.footers = NULL;
-    myopt.topt.format = PRINT_ALIGNED;
-    myopt.topt.expanded = 0;
-    myopt.topt.border = 2;
-    myopt.topt.pager = 0;
-    myopt.topt.tuples_only = false;
-    myopt.topt.start_table = true;
-    myopt.topt.stop_table = true;
-    myopt.topt.default_footer = false;
-    myopt.topt.line_style = NULL;
-    //myopt.topt.fieldSep = NULL;
-    //myopt.topt.recordSep = NULL;
-    myopt.topt.numericLocale = false;
-    myopt.topt.tableAttr = NULL;
-    myopt.topt.encoding = PQenv2encoding();
-    myopt.topt.env_columns = 0;
-    //myopt.topt.columns = 3;
-    myopt.topt.unicode_border_linestyle = UNICODE_LINESTYLE_SINGLE;
-    myopt.topt.unicode_column_linestyle = UNICODE_LINESTYLE_SINGLE;
-    myopt.topt.unicode_header_linestyle = UNICODE_LINESTYLE_SINGLE;
-
-    /* execute it */
-    res = PQexec(conn, query);
+  if (mem_stats_enabled)
+    mem_count(size, MEM_USABLE_SIZE(p, size));
+  return p;
+}
 
-    /* check and deal with errors */
-    if (!res || PQresultStatus(res) > 2)
-    {
-      pg_log_error("query failed: %s", PQerrorMessage(conn));
-      pg_log_info("query was: %s", query);
-      PQclear(res);
-      PQfinish(conn);
-      exit(EXIT_FAILURE);
-    }
+void *
+mem_malloc0(size_t size)
+{
+  void *p = pg_malloc0(size);
 
-    /* print results */
-    printQuery(res, &myopt, stdout, false, NULL);
+  if (mem_stats_enabled)
+    mem_count(size, MEM_USABLE_SIZE(p, size));
+  return p;
+}
 
-    /* cleanup */
-    PQclear(res);
-  }
+void *
+mem_realloc(void *ptr, size_t size)
+{
+  if (mem_stats_enabled && ptr)
+    atomic_fetch_sub_explicit(&mem_live, MEM_USABLE_SIZE(ptr, 0),
+                              memory_order_relaxed);
+  ptr = pg_realloc(ptr, size);
+  if (mem_stats_enabled)
+    mem_count(size, MEM_USABLE_SIZE(ptr, size));
+  return ptr;
 }
 
+char *
+mem_strdup(const char *in)
+{
+  char *p = pg_strdup(in);
 
-/*
- * Close the PostgreSQL connection, and quit
- */
-static void
-quit_properly(SIGNAL_ARGS)
+  if (mem_stats_enabled)
+    mem_count(strlen(p) + 1, MEM_USABLE_SIZE(p, strlen(p) + 1));
+  return p;
+}
+
+void
+mem_free(void *ptr)
 {
-  PQfinish(conn);
-  exit(EXIT_FAILURE);
+  if (mem_stats_enabled && ptr)
+    atomic_fetch_sub_explicit(&mem_live, MEM_USABLE_SIZE(ptr, 0),
+                              memory_order_relaxed);
+  pg_free(ptr);
 }
 
 
 /*
- * Main function
+ * Count a libpq result in the current phase
  */
-int
-main(int argc, char **argv)
+void
+mem_result(const PGresult *res)
 {
-  const char *progname;
-  ConnParams cparams;
-  char       sql[CLIENTCOMPTAGE_DEFAULT_STRING_SIZE];
-
-  /*
-   * If the user stops the program,
-   * quit nicely.
-   */
-  pqsignal(SIGINT, quit_properly);
+  mem_counters *c;
 
-  /* Initialize the logging interface */
-  pg_logging_init(argv[0]);
+  if (!mem_stats_enabled || !res)
+    return;
 
-  /* Get the program name */
-  progname = get_progname(argv[0]);
+  c = &mem_stats[atomic_load_explicit(&mem_phase, memory_order_relaxed)];
+  atomic_fetch_add_explicit(&c->results, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->result_bytes, PQresultMemorySize(res),
+                            memory_order_relaxed);
+}
 
-  /* Allocate the options struct */
-  opts = (struct options *) pg_malloc(sizeof(struct options));
+
+/*
+ * Print the allocation statistics on stderr
+ *
+ * Only the allocations of this file are counted. libpq and the libraries
+ * allocate behind its back, and only the size of the results is known.
+ */
+void
+mem_report(void)
+{
+  static const char *const names[PHASE_COUNT] = {
+    "parse", "connect", "query", "print"
+  };
+  int phase;
+  int k;
+
+  fprintf(stderr, "%-8s %10s %14s %8s %14s\n",
+          "phase", "allocs", "bytes", "results", "result bytes");
+  for (phase = 0; phase < PHASE_COUNT; phase++)
+    fprintf(stderr, "%-8s %10lld %14lld %8lld %14lld\n", names[phase],
+            atomic_load(&mem_stats[phase].allocs),
+            atomic_load(&mem_stats[phase].bytes),
+            atomic_load(&mem_stats[phase].results),
+            atomic_load(&mem_stats[phase].result_bytes));
+  fprintf(stderr, "peak: %lld bytes allocated at once\n",
+          atomic_load(&mem_peak));
+
+  /* sizes, by powers of two */
+  for (phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    if (atomic_load(&mem_stats[phase].allocs) == 0)
+      continue;
+    fprintf(stderr, "%s sizes:", names[phase]);
+    for (k = 0; k < CLIENTCOMPTAGE_MEM_BUCKETS; k++)
+      if (atomic_load(&mem_stats[phase].histogram[k]) > 0)
+        fprintf(stderr, " <=%llu:%lld", 1ULL << k,
+                atomic_load(&mem_stats[phase].histogram[k]));
+    fprintf(stderr, "\n");
+  }
+}
+
+
+/*
+ * From here on, every allocation of this file goes through the counters
+ */
+#define pg_malloc(size) mem_malloc(size)
+#define pg_malloc0(size) mem_malloc0(size)
+#define pg_realloc(ptr, size) mem_realloc(ptr, size)
+#define pg_strdup(in) mem_strdup(in)
+#define pg_free(ptr) mem_free(ptr)
+
+
+/*
+ * Initialize an arena, without allocating anything yet
+ */
+void
+arena_init(arena *a, size_t block_size)
+{
+  memset(a, 0, sizeof(arena));
+  a->block_size = block_size;
+}
+
+
+/*
+ * Allocate memory from an arena
+ *
+ * Blocks kept by a reset are reused first, a new block is only malloc'ed
+ * when none of them has enough room left.
+ */
+void *
+arena_alloc(arena *a, size_t size)
+{
+  arena_block *b;
+  void        *p;
+
+  size = MAXALIGN(Max(size, 1));
+
+  for (b = a->current; b && b->size - b->used < size; b = b->next)
+    ;
+
+  if (!b)
+  {
+    b = (arena_block *) pg_malloc(offsetof(arena_block, data)
+                                  + Max(size, a->block_size));
+    b->next = NULL;
+    b->size = Max(size, a->block_size);
+    b->used = 0;
+    if (a->last)
+      a->last->next = b;
+    else
+      a->first = b;
+    a->last = b;
+    a->blocks++;
+  }
+
+  p = b->data + b->used;
+  b->used += size;
+  a->current = b;
+  a->used += size;
+  a->peak = Max(a->peak, a->used);
+  a->allocs++;
+  return p;
+}
+
+
+/*
+ * Copy a string into an arena
+ */
+char *
+arena_strdup(arena *a, const char *in)
+{
+  size_t len = strlen(in) + 1;
+
+  return (char *) memcpy(arena_alloc(a, len), in, len);
+}
+
+
+/*
+ * Format a string into an arena
+ */
+char *
+arena_psprintf(arena *a, const char *fmt,...)
+{
+  va_list args;
+  char    *out;
+  int     len;
+
+  va_start(args, fmt);
+  len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+
+  out = (char *) arena_alloc(a, len + 1);
+
+  va_start(args, fmt);
+  vsnprintf(out, len + 1, fmt, args);
+  va_end(args);
+
+  return out;
+}
+
+
+/*
+ * Give back everything allocated from an arena, keeping its blocks
+ */
+void
+arena_reset(arena *a)
+{
+  arena_block *b;
+
+  for (b = a->first; b; b = b->next)
+    b->used = 0;
+  a->current = a->first;
+  a->used = 0;
+  a->resets++;
+}
+
+
+/*
+ * Release the blocks of an arena
+ */
+void
+arena_free(arena *a)
+{
+  arena_block *b;
+  arena_block *next;
+
+  for (b = a->first; b; b = next)
+  {
+    next = b->next;
+    pg_free(b);
+  }
+  arena_init(a, a->block_size);
+}
+
+
+/*
+ * Log the allocation counters of an arena
+ */
+static void
+arena_report(const char *name, const arena *a)
+{
+  pg_log_info("%s arena: " INT64_FORMAT " allocations, " INT64_FORMAT
+              " blocks malloc'ed, " INT64_FORMAT " resets, peak %zu bytes",
+              name, a->allocs, a->blocks, a->resets, a->peak);
+}
+
+
+/*
+ * Shared buffer to format a value before copying it into an arena
+ *
+ * Only the main thread uses it.
+ */
+static PQExpBuffer
+scratch_buffer(void)
+{
+  static PQExpBuffer scratch = NULL;
+
+  if (!scratch)
+    scratch = createPQExpBuffer();
+  else
+    resetPQExpBuffer(scratch);
+  return scratch;
+}
+
+
+/*
+ * Compare given major and minor numbers to the one of the connected server
+ */
+bool
+backend_minimum_version(int major, int minor)
+{
+  return opts->major > major || (opts->major == major && opts->minor >= minor);
+}
+
+
+/*
+ * Record the server version and what it, and libpq, can do
+ */
+void
+set_capabilities(void)
+{
+  int version = PQserverVersion(conn);
+  int libversion = PQlibVersion();
+
+  /* before 10, the minor number is the second one */
+  opts->major = version / 10000;
+  opts->minor = version >= 100000 ? version % 10000 : (version / 100) % 100;
+
+  caps.range_offset = backend_minimum_version(11, 0);
+  caps.generated_columns = backend_minimum_version(12, 0);
+  caps.date_bin = backend_minimum_version(14, 0);
+  caps.merge = backend_minimum_version(15, 0);
+#ifdef LIBPQ_HAS_PIPELINING
+  caps.pipeline = backend_minimum_version(14, 0) && libversion >= 140000;
+#else
+  caps.pipeline = false;
+#endif
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  caps.chunked_rows = backend_minimum_version(17, 0) && libversion >= 170000;
+#else
+  caps.chunked_rows = false;
+#endif
+
+  if (opts->verbose)
+    pg_log_info("server %d.%d, libpq %d: range offset %s, generated columns %s, "
+                "pipeline %s, date_bin %s, merge %s, chunked rows %s",
+                opts->major, opts->minor, libversion / 10000,
+                caps.range_offset ? "yes" : "no",
+                caps.generated_columns ? "yes" : "no",
+                caps.pipeline ? "yes" : "no",
+                caps.date_bin ? "yes" : "no",
+                caps.merge ? "yes" : "no",
+                caps.chunked_rows ? "yes" : "no");
+}
+
+
+/*
+ * Generate a random entry key, as an hexadecimal string
+ *
+ * The key buffer must hold at least 2 * CLIENTCOMPTAGE_KEY_SIZE + 1 bytes.
+ */
+void
+generate_entry_key(char *key)
+{
+  uint8 bytes[CLIENTCOMPTAGE_KEY_SIZE];
+  int   i;
+
+  if (!pg_strong_random(bytes, sizeof(bytes)))
+  {
+    pg_log_error("could not generate random entry key");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < CLIENTCOMPTAGE_KEY_SIZE; i++)
+    sprintf(key + 2 * i, "%02x", bytes[i]);
+}
+
+
+/*
+ * Wait before the next connection attempt
+ *
+ * Exponential backoff with full jitter: the delay is randomly chosen
+ * between zero and base * 2^attempt, capped to the maximum delay.
+ */
+static void
+retry_delay(int attempt)
+{
+  long   ceiling;
+  uint32 r;
+
+  ceiling = (long) CLIENTCOMPTAGE_RETRY_BASE_DELAY << Min(attempt, 10);
+  if (ceiling > CLIENTCOMPTAGE_RETRY_MAX_DELAY)
+    ceiling = CLIENTCOMPTAGE_RETRY_MAX_DELAY;
+
+  if (!pg_strong_random(&r, sizeof(r)))
+    r = (uint32) getpid();
+
+  pg_usleep(r % ceiling);
+}
+
+
+/*
+ * Send a query, reconnecting and retrying if the connection was lost
+ *
+ * Only connection failures are retried. Any other error is returned to
+ * the caller. Callers must only send statements that are safe to replay.
+ * format is the wanted result format, 0 for text and 1 for binary.
+ */
+PGresult *
+run_query(const char *query, int nparams, const char *const *values,
+          int format)
+{
+  PGresult *results;
+  int       attempt;
+
+  for (attempt = 0;; attempt++)
+  {
+    results = PQexecParams(conn, query, nparams, NULL, values,
+                           NULL, NULL, format);
+
+    if (PQstatus(conn) != CONNECTION_BAD
+        || attempt >= CLIENTCOMPTAGE_MAX_RETRIES)
+    {
+      mem_result(results);
+      return results;
+    }
+
+    PQclear(results);
+    pg_log_warning("connection lost, retrying (%d/%d)",
+                   attempt + 1, CLIENTCOMPTAGE_MAX_RETRIES);
+    retry_delay(attempt);
+    PQreset(conn);
+  }
+}
+
+
+/*
+ * Send a query once, aborting if the connection is lost
+ *
+ * For statements inside an explicit transaction: a replay after
+ * PQreset() would run in a new session, outside the transaction and
+ * without its locks. The server rolls the transaction back when the
+ * connection drops.
+ */
+PGresult *
+run_query_once(const char *query, int nparams, const char *const *values,
+               int format)
+{
+  PGresult *results;
+
+  results = PQexecParams(conn, query, nparams, NULL, values,
+                         NULL, NULL, format);
+  mem_result(results);
+
+  if (PQstatus(conn) == CONNECTION_BAD)
+  {
+    pg_log_error("connection lost in the middle of a transaction: %s",
+                 PQerrorMessage(conn));
+    pg_log_info("query was: %s", query);
+    PQclear(results);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  return results;
+}
+
+
+/*
+ * Execute query once, inside an explicit transaction
+ */
+void
+execute_once(char *query)
+{
+  PGresult *results;
+
+  if (opts->script)
+  {
+    printf("%s;\n", query);
+    return;
+  }
+
+  results = run_query_once(query, 0, NULL, 0);
+  if (PQresultStatus(results) != PGRES_COMMAND_OK)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", query);
+    PQclear(results);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  PQclear(results);
+}
+
+
+/*
+ * Execute query
+ */
+void
+execute(char *query)
+{
+  PGresult *results;
+
+  if (opts->script)
+  {
+    printf("%s;\n", query);
+  }
+  else
+  {
+    /* make the call */
+    results = run_query(query, 0, NULL, 0);
+
+    /* check and deal with errors */
+    if (!results || PQresultStatus(results) != PGRES_COMMAND_OK)
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      pg_log_info("query was: %s", query);
+      PQclear(results);
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+
+    /* cleanup */
+    PQclear(results);
+  }
+}
+
+
+/*
+ * Set the printing options shared by every report
+ */
+static void
+init_print_options(printQueryOpt *myopt, char *label)
+{
+  myopt->nullPrint = NULL;
+  myopt->title = arena_strdup(&query_arena, label);
+  myopt->translate_header = false;
+  myopt->n_translate_columns = 0;
+  myopt->translate_columns = NULL;
+  myopt->footers = NULL;
+  myopt->topt.format = PRINT_ALIGNED;
+  myopt->topt.expanded = 0;
+  myopt->topt.border = 2;
+  myopt->topt.pager = 0;
+  myopt->topt.tuples_only = false;
+  myopt->topt.start_table = true;
+  myopt->topt.stop_table = true;
+  myopt->topt.default_footer = false;
+  myopt->topt.line_style = NULL;
+  //myopt->topt.fieldSep = NULL;
+  //myopt->topt.recordSep = NULL;
+  myopt->topt.numericLocale = false;
+  myopt->topt.tableAttr = NULL;
+  myopt->topt.encoding = PQenv2encoding();
+  myopt->topt.env_columns = 0;
+  //myopt->topt.columns = 3;
+  myopt->topt.unicode_border_linestyle = UNICODE_LINESTYLE_SINGLE;
+  myopt->topt.unicode_column_linestyle = UNICODE_LINESTYLE_SINGLE;
+  myopt->topt.unicode_header_linestyle = UNICODE_LINESTYLE_SINGLE;
+}
+
+
+/*
+ * Handle query
+ */
+void
+fetch_table(char *label, const char *query, int nparams,
+            const char *const *values)
+{
+  PGresult      *res;
+  printQueryOpt myopt;
+
+  if (opts->script)
+  {
+    printf("\\echo %s\n",label);
+    printf("%s;\n",query);
+  }
+  else if (opts->format != FORMAT_ALIGNED)
+  {
+    stream_table(label, query, nparams, values);
+  }
+  else if (opts->max_memory > 0)
+  {
+    spill_table(label, query, nparams, values);
+  }
+  else
+  {
+    atomic_store(&mem_phase, PHASE_QUERY);
+    init_print_options(&myopt, label);
+
+    /* execute it, asking for binary results */
+    res = run_query(query, nparams, values, 1);
+
+    /* check and deal with errors */
+    if (!res || PQresultStatus(res) > 2)
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      pg_log_info("query was: %s", query);
+      PQclear(res);
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+
+    /* print results */
+    atomic_store(&mem_phase, PHASE_PRINT);
+    print_binary_result(res, &myopt);
+
+    /* cleanup */
+    PQclear(res);
+    arena_reset(&query_arena);
+  }
+}
+
+
+/*
+ * Get the names and types of the two columns of a report view
+ *
+ * Names are quoted if needed, and types come from format_type(), so that
+ * both can be pasted in a query.
+ */
+static void
+view_columns(const char *view, char **names, char **types)
+{
+  const char *values[1];
+  PGresult   *res;
+  int        i;
+
+  values[0] = view;
+  res = run_query("SELECT attname, format_type(atttypid, atttypmod) "
+                  "FROM pg_catalog.pg_attribute "
+                  "WHERE attrelid = $1::regclass AND attnum > 0 "
+                  "AND NOT attisdropped ORDER BY attnum",
+                  1, values, 0);
+  if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    pg_log_error("could not describe view \"%s\": %s", view,
+                 PQerrorMessage(conn));
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  if (PQntuples(res) != 2)
+  {
+    pg_log_error("view \"%s\" does not have two columns, cannot filter it",
+                 view);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 2; i++)
+  {
+    names[i] = arena_strdup(&query_arena, fmtId(PQgetvalue(res, i, 0)));
+    types[i] = arena_strdup(&query_arena, PQgetvalue(res, i, 1));
+  }
+  PQclear(res);
+}
+
+
+/*
+ * Report the time spent per bucket of any granularity
+ *
+ * Named granularities use date_trunc(), any other value is an interval
+ * for date_bin(). Buckets are computed in the local time of --tz, and
+ * --from/--to/--last only filter on deb, so that an index on deb bounds
+ * the scan to the requested window.
+ *
+ * With a view, -m or -s with a range, the view's aggregation is computed
+ * on the filtered rows, with the view's column names and types, so that
+ * the output is the same as the view's.
+ */
+void
+bucket_report(const char *view)
+{
+  static char *const units[][4] = {
+    {"hour", "heure", "Heures", "1 hour"},
+    {"day", "jour", "Jours", "1 day"},
+    {"week", "semaine", "Semaines", "1 week"},
+    {"month", "mois", "Mois", "1 month"},
+    {"quarter", "trimestre", "Trimestres", "3 months"},
+    {"year", "annee", "Années", "1 year"}
+  };
+  PQExpBufferData sql;
+  const char      *values[5];
+  char            *label = "Périodes";
+  char            count[16];
+  char            *names[2];
+  char            *types[2];
+  char            start[64];
+  char            step[32];
+  int             nparams = 0;
+  int             unit = -1;
+  int             stride = 0;
+  int             from = 0;
+  int             to = 0;
+  int             last = 0;
+  int             i;
+
+  for (i = 0; i < (int) lengthof(units); i++)
+    if (strcmp(opts->bucket, units[i][0]) == 0)
+      unit = i;
+
+  if (unit < 0 && !caps.date_bin)
+  {
+    pg_log_error("--bucket with an interval needs PostgreSQL 14 or later");
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* $1 is always the timezone, the others only when needed */
+  values[nparams++] = opts->tz ? opts->tz : PQparameterStatus(conn, "TimeZone");
+  if (!values[0])
+    values[0] = "UTC";
+  if (unit < 0)
+  {
+    values[nparams++] = opts->bucket;
+    stride = nparams;
+  }
+  if (opts->from)
+  {
+    values[nparams++] = opts->from;
+    from = nparams;
+  }
+  if (opts->to)
+  {
+    values[nparams++] = opts->to;
+    to = nparams;
+  }
+  if (opts->last)
+  {
+    snprintf(count, sizeof(count), "%d", opts->last - 1);
+    values[nparams++] = count;
+    last = nparams;
+  }
+
+  initPQExpBuffer(&sql);
+  if (view)
+  {
+    view_columns(view, names, types);
+    label = units[unit][2];
+    appendPQExpBuffer(&sql, "SELECT date_trunc('%s', deb AT TIME ZONE $1)::%s AS %s, "
+                      "sum(fin - deb)::%s AS %s FROM public.comptage "
+                      "WHERE deb IS NOT NULL AND fin IS NOT NULL",
+                      units[unit][0], types[0], names[0], types[1], names[1]);
+  }
+  else if (unit > 0)
+  {
+    label = units[unit][2];
+    appendPQExpBuffer(&sql, "SELECT date_trunc('%s', deb AT TIME ZONE $1)::date AS %s, "
+                      "sum(fin - deb) AS total FROM public.comptage "
+                      "WHERE deb IS NOT NULL AND fin IS NOT NULL",
+                      units[unit][0], units[unit][1]);
+  }
+  else
+  {
+    /*
+     * Hours and intervals are shorter than an entry, which is split at
+     * the bucket boundaries like in the heatmap.
+     */
+    if (unit == 0)
+    {
+      label = units[unit][2];
+      snprintf(step, sizeof(step), "interval '1 hour'");
+      snprintf(start, sizeof(start), "date_trunc('hour', d)");
+    }
+    else
+    {
+      snprintf(step, sizeof(step), "$%d::interval", stride);
+      if (from)
+        snprintf(start, sizeof(start), "date_bin($%d::interval, d, $%d::timestamp)",
+                 stride, from);
+      else
+        snprintf(start, sizeof(start), "date_bin($%d::interval, d, "
+                 "timestamp '2000-01-03')", stride);
+    }
+    appendPQExpBuffer(&sql, "SELECT b AS %s, sum(least(f, b + %s) - greatest(d, b)) "
+                      "AS total FROM (SELECT deb AT TIME ZONE $1 AS d, "
+                      "fin AT TIME ZONE $1 AS f FROM public.comptage "
+                      "WHERE deb IS NOT NULL AND fin IS NOT NULL AND fin > deb",
+                      unit == 0 ? units[unit][1] : "periode", step);
+  }
+
+  if (from)
+    appendPQExpBuffer(&sql, " AND deb >= $%d::timestamp AT TIME ZONE $1", from);
+  if (to)
+    appendPQExpBuffer(&sql, " AND deb < $%d::timestamp AT TIME ZONE $1", to);
+
+  /* the current bucket, and the N - 1 before it */
+  if (last && unit >= 0)
+    appendPQExpBuffer(&sql, " AND deb >= (date_trunc('%s', now() AT TIME ZONE $1)"
+                      " - $%d::int * interval '%s') AT TIME ZONE $1",
+                      units[unit][0], last, units[unit][3]);
+  else if (last)
+    appendPQExpBuffer(&sql, " AND deb >= (date_bin($%d::interval, now() AT TIME ZONE $1,"
+                      " timestamp '2000-01-03') - $%d::int * $%d::interval)"
+                      " AT TIME ZONE $1", stride, last, stride);
+  if (!view && unit <= 0)
+  {
+    appendPQExpBuffer(&sql, ") c, generate_series(%s, f - interval '1 microsecond', "
+                      "%s) b", start, step);
+    /* the end of the last entries is not reported past --to */
+    if (to)
+      appendPQExpBuffer(&sql, " WHERE b < $%d::timestamp", to);
+  }
+  appendPQExpBufferStr(&sql, " GROUP BY 1 ORDER BY 1");
+
+  fetch_table(label, sql.data, nparams, values);
+  termPQExpBuffer(&sql);
+}
+
+
+/*
+ * Use the server timezone for local times
+ *
+ * Binary timestamps are converted client-side, so they need the same
+ * timezone as the server session to be displayed the same way.
+ */
+void
+set_local_timezone(void)
+{
+  const char *tz = PQparameterStatus(conn, "TimeZone");
+
+  if (tz)
+  {
+    setenv("TZ", tz, 1);
+    tzset();
+  }
+}
+
+
+/*
+ * Proleptic Gregorian date of a number of days since 1970-01-01
+ */
+static void
+civil_from_days(int64 days, int *y, int *m, int *d)
+{
+  int64 era;
+  int   doe;
+  int   yoe;
+  int   doy;
+  int   mp;
+
+  days += 719468;
+  era = (days >= 0 ? days : days - 146096) / 146097;
+  doe = days - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+
+/*
+ * Append a timestamp, given in microseconds since the Unix epoch, the way
+ * the server formats it with the ISO datestyle
+ */
+static void
+append_timestamp(PQExpBuffer out, int64 usecs, bool with_zone)
+{
+  char      buf[64];
+  char      *p = buf;
+  int64     secs;
+  int64     days;
+  int64     offset = 0;
+  int       fsec;
+  int       y, m, d;
+  struct tm tm;
+  time_t    t;
+
+  secs = usecs / USECS_PER_SEC;
+  fsec = usecs % USECS_PER_SEC;
+  if (fsec < 0)
+  {
+    secs--;
+    fsec += USECS_PER_SEC;
+  }
+
+  if (with_zone)
+  {
+    t = (time_t) secs;
+    localtime_r(&t, &tm);
+    offset = tm.tm_gmtoff;
+    secs += offset;
+  }
+
+  days = secs / SECS_PER_DAY - (secs % SECS_PER_DAY < 0);
+  secs -= days * SECS_PER_DAY;
+  civil_from_days(days, &y, &m, &d);
+
+  p += sprintf(p, "%04d-%02d-%02d %02d:%02d:%02d", y, m, d,
+               (int) (secs / 3600), (int) (secs / 60 % 60), (int) (secs % 60));
+  if (fsec)
+  {
+    p += sprintf(p, ".%06d", fsec);
+    while (p[-1] == '0')
+      *--p = '\0';
+  }
+  if (with_zone)
+  {
+    p += sprintf(p, "%c%02d", offset < 0 ? '-' : '+',
+                 (int) (Abs(offset) / 3600));
+    if (Abs(offset) % 3600)
+      p += sprintf(p, ":%02d", (int) (Abs(offset) / 60 % 60));
+  }
+
+  appendBinaryPQExpBuffer(out, buf, p - buf);
+}
+
+
+/*
+ * Append one field of an interval, like AddPostgresIntPart() in the server
+ *
+ * A field gets a + when the previous nonzero one was negative.
+ */
+static char *
+append_interval_part(char *p, int64 value, const char *unit,
+                     bool *is_zero, bool *is_before)
+{
+  if (value == 0)
+    return p;
+  p += sprintf(p, "%s%s%lld %s%s", *is_zero ? "" : " ",
+               *is_before && value > 0 ? "+" : "", (long long) value,
+               unit, value != 1 ? "s" : "");
+  *is_before = value < 0;
+  *is_zero = false;
+  return p;
+}
+
+
+/*
+ * Append an interval the way the server formats it with the postgres style
+ */
+static void
+append_interval(PQExpBuffer out, int64 time, int32 days, int32 months)
+{
+  char  buf[128];
+  char  *p = buf;
+  int64 t = time < 0 ? -(uint64) time : time;
+  int   fsec;
+  bool  is_zero = true;
+  bool  is_before = false;
+
+  p = append_interval_part(p, months / 12, "year", &is_zero, &is_before);
+  p = append_interval_part(p, months % 12, "mon", &is_zero, &is_before);
+  p = append_interval_part(p, days, "day", &is_zero, &is_before);
+
+  if (is_zero || time != 0)
+  {
+    fsec = t % USECS_PER_SEC;
+    t /= USECS_PER_SEC;
+    p += sprintf(p, "%s%s%02lld:%02d:%02d", is_zero ? "" : " ",
+                 time < 0 ? "-" : is_before ? "+" : "",
+                 (long long) (t / 3600), (int) (t / 60 % 60), (int) (t % 60));
+    if (fsec)
+    {
+      p += sprintf(p, ".%06d", fsec);
+      while (p[-1] == '0')
+        p--;
+    }
+  }
+
+  appendBinaryPQExpBuffer(out, buf, p - buf);
+}
+
+
+/*
+ * Append a float the way float4out and float8out do
+ *
+ * The server prints the shortest digits that read back as the same value,
+ * in exponent notation from 1e-5 down and from 10^FLT_DIG or 10^DBL_DIG up.
+ */
+static void
+append_float(PQExpBuffer out, double value, bool single)
+{
+  char buf[64];
+  int  prec;
+  int  exp;
+
+  if (isnan(value))
+  {
+    appendPQExpBufferStr(out, "NaN");
+    return;
+  }
+  if (isinf(value))
+  {
+    appendPQExpBufferStr(out, value > 0 ? "Infinity" : "-Infinity");
+    return;
+  }
+
+  for (prec = 1; prec < (single ? 9 : 17); prec++)
+  {
+    snprintf(buf, sizeof(buf), "%.*e", prec - 1, value);
+    if (single ? strtof(buf, NULL) == (float) value : strtod(buf, NULL) == value)
+      break;
+  }
+  snprintf(buf, sizeof(buf), "%.*e", prec - 1, value);
+
+  exp = atoi(strchr(buf, 'e') + 1);
+  if (exp < -4 || exp >= (single ? FLT_DIG : DBL_DIG))
+    appendPQExpBufferStr(out, buf);
+  else
+    appendPQExpBuffer(out, "%.*f", Max(prec - 1 - exp, 0), value);
+}
+
+
+/*
+ * Format an interval in a new string
+ */
+static char *
+format_interval(int64 time, int32 days, int32 months)
+{
+  PQExpBuffer buf = scratch_buffer();
+
+  append_interval(buf, time, days, months);
+  return arena_strdup(&query_arena, buf->data);
+}
+
+
+/*
+ * Append a numeric from its binary representation
+ *
+ * Digits are sent in base 10000, weight being the power of 10000 of the
+ * first one, and dscale the number of decimal digits to display.
+ */
+static void
+append_numeric(PQExpBuffer out, const char *v)
+{
+  int16  ndigits;
+  int16  weight;
+  uint16 sign;
+  int16  dscale;
+  int16  digit;
+  int    i;
+  size_t frac;
+
+  ndigits = (int16) pg_ntoh16(*(uint16 *) v);
+  weight = (int16) pg_ntoh16(*(uint16 *) (v + 2));
+  sign = pg_ntoh16(*(uint16 *) (v + 4));
+  dscale = (int16) pg_ntoh16(*(uint16 *) (v + 6));
+  v += 8;
+
+  if (sign == 0xC000)
+  {
+    appendPQExpBufferStr(out, "NaN");
+    return;
+  }
+  if (sign == 0xD000 || sign == 0xF000)
+  {
+    appendPQExpBufferStr(out, sign == 0xD000 ? "Infinity" : "-Infinity");
+    return;
+  }
+
+  if (sign == 0x4000)
+    appendPQExpBufferChar(out, '-');
+
+  /* integer part */
+  if (weight < 0)
+    appendPQExpBufferChar(out, '0');
+  for (i = 0; i <= weight; i++)
+  {
+    digit = i < ndigits ? (int16) pg_ntoh16(*(uint16 *) (v + 2 * i)) : 0;
+    appendPQExpBuffer(out, i == 0 ? "%d" : "%04d", digit);
+  }
+
+  /* fractional part, truncated to dscale digits */
+  if (dscale > 0)
+  {
+    appendPQExpBufferChar(out, '.');
+    frac = out->len;
+    for (i = weight + 1; out->len - frac < (size_t) dscale; i++)
+    {
+      digit = i >= 0 && i < ndigits ? (int16) pg_ntoh16(*(uint16 *) (v + 2 * i)) : 0;
+      appendPQExpBuffer(out, "%04d", digit);
+    }
+    out->len = frac + dscale;
+    out->data[out->len] = '\0';
+  }
+}
+
+
+/*
+ * Append the text representation of a binary value
+ *
+ * Types the tool does not know are displayed as hexadecimal bytes.
+ */
+void
+append_binary_value(PQExpBuffer out, const char *v, int len, Oid type)
+{
+  int32  i32;
+  int64  i64;
+  float4 f4;
+  float8 f8;
+  int    y, m, d;
+  int    i;
+
+  switch (type)
+  {
+    case BOOLOID:
+      appendPQExpBufferChar(out, *v ? 't' : 'f');
+      break;
+    case INT2OID:
+      appendPQExpBuffer(out, "%d", (int16) pg_ntoh16(*(uint16 *) v));
+      break;
+    case INT4OID:
+      appendPQExpBuffer(out, "%d", (int32) pg_ntoh32(*(uint32 *) v));
+      break;
+    case INT8OID:
+      appendPQExpBuffer(out, INT64_FORMAT, (int64) pg_ntoh64(*(uint64 *) v));
+      break;
+    case FLOAT4OID:
+      i32 = pg_ntoh32(*(uint32 *) v);
+      memcpy(&f4, &i32, sizeof(f4));
+      append_float(out, f4, true);
+      break;
+    case FLOAT8OID:
+      i64 = pg_ntoh64(*(uint64 *) v);
+      memcpy(&f8, &i64, sizeof(f8));
+      append_float(out, f8, false);
+      break;
+    case NUMERICOID:
+      append_numeric(out, v);
+      break;
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+    case NAMEOID:
+      appendBinaryPQExpBuffer(out, v, len);
+      break;
+    case DATEOID:
+      i32 = pg_ntoh32(*(uint32 *) v);
+      if (i32 == PG_INT32_MAX || i32 == PG_INT32_MIN)
+      {
+        appendPQExpBufferStr(out, i32 > 0 ? "infinity" : "-infinity");
+        break;
+      }
+      civil_from_days(i32 + POSTGRES_EPOCH_DAYS, &y, &m, &d);
+      appendPQExpBuffer(out, "%04d-%02d-%02d", y, m, d);
+      break;
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+      i64 = pg_ntoh64(*(uint64 *) v);
+      if (i64 == PG_INT64_MAX || i64 == PG_INT64_MIN)
+      {
+        appendPQExpBufferStr(out, i64 > 0 ? "infinity" : "-infinity");
+        break;
+      }
+      append_timestamp(out, i64 + POSTGRES_EPOCH_USECS, type == TIMESTAMPTZOID);
+      break;
+    case INTERVALOID:
+      append_interval(out, pg_ntoh64(*(uint64 *) v),
+                      pg_ntoh32(*(uint32 *) (v + 8)),
+                      pg_ntoh32(*(uint32 *) (v + 12)));
+      break;
+    default:
+      appendPQExpBufferStr(out, "\\x");
+      for (i = 0; i < len; i++)
+        appendPQExpBuffer(out, "%02x", (unsigned char) v[i]);
+      break;
+  }
+}
+
+
+/*
+ * Turn a binary value into a new text string
+ */
+char *
+format_binary_value(const char *v, int len, Oid type)
+{
+  PQExpBuffer buf = scratch_buffer();
+
+  append_binary_value(buf, v, len, type);
+  return arena_strdup(&query_arena, buf->data);
+}
+
+
+/*
+ * Append a text value, quoted for CSV if it needs to be
+ */
+static void
+append_csv(PQExpBuffer out, const char *v, int len)
+{
+  int i;
+
+  if (len > 0 && strpbrk(v, ",\"\n\r") == NULL)
+  {
+    appendBinaryPQExpBuffer(out, v, len);
+    return;
+  }
+
+  appendPQExpBufferChar(out, '"');
+  for (i = 0; i < len; i++)
+  {
+    if (v[i] == '"')
+      appendPQExpBufferChar(out, '"');
+    appendPQExpBufferChar(out, v[i]);
+  }
+  appendPQExpBufferChar(out, '"');
+}
+
+
+/*
+ * Append a text value, escaped the way COPY text format does
+ */
+static void
+append_tsv(PQExpBuffer out, const char *v, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+  {
+    switch (v[i])
+    {
+      case '\\':
+        appendPQExpBufferStr(out, "\\\\");
+        break;
+      case '\t':
+        appendPQExpBufferStr(out, "\\t");
+        break;
+      case '\n':
+        appendPQExpBufferStr(out, "\\n");
+        break;
+      case '\r':
+        appendPQExpBufferStr(out, "\\r");
+        break;
+      default:
+        appendPQExpBufferChar(out, v[i]);
+    }
+  }
+}
+
+
+/*
+ * Append a JSON string
+ */
+static void
+append_json_string(PQExpBuffer out, const char *v, int len)
+{
+  int i;
+
+  appendPQExpBufferChar(out, '"');
+  for (i = 0; i < len; i++)
+  {
+    switch (v[i])
+    {
+      case '"':
+        appendPQExpBufferStr(out, "\\\"");
+        break;
+      case '\\':
+        appendPQExpBufferStr(out, "\\\\");
+        break;
+      case '\n':
+        appendPQExpBufferStr(out, "\\n");
+        break;
+      case '\r':
+        appendPQExpBufferStr(out, "\\r");
+        break;
+      case '\t':
+        appendPQExpBufferStr(out, "\\t");
+        break;
+      default:
+        if ((unsigned char) v[i] < 0x20)
+          appendPQExpBuffer(out, "\\u%04x", (unsigned char) v[i]);
+        else
+          appendPQExpBufferChar(out, v[i]);
+    }
+  }
+  appendPQExpBufferChar(out, '"');
+}
+
+
+/*
+ * Decode a binary result and print it
+ */
+void
+print_binary_result(const PGresult *res, const printQueryOpt *opt)
+{
+  printTableContent cont;
+  int               nfields = PQnfields(res);
+  int               ntuples = PQntuples(res);
+  int               r;
+  int               c;
+
+  printTableInit(&cont, &opt->topt, opt->title, nfields, ntuples);
+
+  for (c = 0; c < nfields; c++)
+    printTableAddHeader(&cont, PQfname(res, c), opt->translate_header,
+                        column_type_alignment(PQftype(res, c)));
+
+  for (r = 0; r < ntuples; r++)
+  {
+    for (c = 0; c < nfields; c++)
+    {
+      if (PQgetisnull(res, r, c))
+        printTableAddCell(&cont, opt->nullPrint ? opt->nullPrint : "",
+                          false, false);
+      else
+        printTableAddCell(&cont,
+                          format_binary_value(PQgetvalue(res, r, c),
+                                              PQgetlength(res, r, c),
+                                              PQftype(res, c)),
+                          false, false);
+    }
+  }
+
+  printTable(&cont, stdout, false, NULL);
+  printTableCleanup(&cont);
+}
+
+
+/*
+ * Initialize a queue, size must be a power of two
+ */
+void
+spsc_init(spsc_queue *q, size_t size)
+{
+  q->items = (void **) pg_malloc(size * sizeof(void *));
+  q->mask = size - 1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->sleepers, 0);
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+}
+
+
+/*
+ * Release a queue
+ */
+void
+spsc_destroy(spsc_queue *q)
+{
+  pg_free(q->items);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->cond);
+}
+
+
+/*
+ * Wake the other side of a queue if it sleeps
+ *
+ * head and tail are stored, and sleepers incremented, with sequential
+ * consistency: either the sleeper sees the new position before waiting,
+ * or this sees the sleeper and broadcasts under the lock.
+ */
+static void
+spsc_wake(spsc_queue *q)
+{
+  if (atomic_load(&q->sleepers) > 0)
+  {
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+
+/*
+ * Add an item to a queue, waiting for room if needed
+ */
+void
+spsc_push(spsc_queue *q, void *item)
+{
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  int    spins = 0;
+
+  while (head - atomic_load(&q->tail) > q->mask)
+  {
+    if (++spins < CLIENTCOMPTAGE_SPIN_LIMIT)
+    {
+      sched_yield();
+      continue;
+    }
+    pthread_mutex_lock(&q->lock);
+    atomic_fetch_add(&q->sleepers, 1);
+    while (head - atomic_load(&q->tail) > q->mask)
+      pthread_cond_wait(&q->cond, &q->lock);
+    atomic_fetch_sub(&q->sleepers, 1);
+    pthread_mutex_unlock(&q->lock);
+  }
+
+  q->items[head & q->mask] = item;
+  atomic_store(&q->head, head + 1);
+  spsc_wake(q);
+}
+
+
+/*
+ * Take the oldest item of a queue, waiting for one if needed
+ */
+void *
+spsc_pop(spsc_queue *q)
+{
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  void   *item;
+  int    spins = 0;
+
+  while (atomic_load(&q->head) == tail)
+  {
+    if (++spins < CLIENTCOMPTAGE_SPIN_LIMIT)
+    {
+      sched_yield();
+      continue;
+    }
+    pthread_mutex_lock(&q->lock);
+    atomic_fetch_add(&q->sleepers, 1);
+    while (atomic_load(&q->head) == tail)
+      pthread_cond_wait(&q->cond, &q->lock);
+    atomic_fetch_sub(&q->sleepers, 1);
+    pthread_mutex_unlock(&q->lock);
+  }
+
+  item = q->items[tail & q->mask];
+  atomic_store(&q->tail, tail + 1);
+  spsc_wake(q);
+  return item;
+}
+
+
+/*
+ * Number of characters of an UTF-8 string
+ */
+static int
+display_width(const char *s, int len)
+{
+  int width = 0;
+  int i;
+
+  for (i = 0; i < len; i++)
+    width += ((unsigned char) s[i] & 0xC0) != 0x80;
+  return width;
+}
+
+
+/*
+ * Append a horizontal rule of the streamed aligned format
+ */
+static void
+append_rule(PQExpBuffer out, const report_pipeline *pl, int nfields)
+{
+  int c;
+  int i;
+
+  for (c = 0; c < nfields; c++)
+  {
+    appendPQExpBufferChar(out, '+');
+    for (i = 0; i < pl->widths[c] + 2; i++)
+      appendPQExpBufferChar(out, '-');
+  }
+  appendPQExpBufferStr(out, "+\n");
+}
+
+
+/*
+ * Append a cell of the streamed aligned format
+ *
+ * Values wider than their column are truncated, the last character
+ * being replaced with "~".
+ */
+static void
+append_padded(PQExpBuffer out, const char *v, int len, int width, char align)
+{
+  int w = display_width(v, len);
+  int pad;
+  int i;
+
+  if (w > width)
+  {
+    /* keep width - 1 characters */
+    for (i = 0, w = 0; i < len && w < width - 1; i++)
+      w += ((unsigned char) v[i] & 0xC0) != 0x80;
+    while (i < len && ((unsigned char) v[i] & 0xC0) == 0x80)
+      i++;
+    appendBinaryPQExpBuffer(out, v, i);
+    appendPQExpBufferChar(out, '~');
+    return;
+  }
+
+  pad = width - w;
+  if (align == 'c')
+  {
+    for (i = 0; i < pad / 2; i++)
+      appendPQExpBufferChar(out, ' ');
+    pad -= pad / 2;
+  }
+  else if (align == 'r')
+  {
+    for (i = 0; i < pad; i++)
+      appendPQExpBufferChar(out, ' ');
+    pad = 0;
+  }
+  appendBinaryPQExpBuffer(out, v, len);
+  for (i = 0; i < pad; i++)
+    appendPQExpBufferChar(out, ' ');
+}
+
+
+/*
+ * Size the columns of the streamed aligned format from sampled rows
+ */
+static void
+sample_widths(report_pipeline *pl, const PGresult *row)
+{
+  int nfields = PQnfields(row);
+  int c;
+  int r;
+  int t;
+
+  pl->widths = (int *) pg_malloc0(Max(nfields, 1) * sizeof(int));
+  for (c = 0; c < nfields; c++)
+    pl->widths[c] = display_width(PQfname(row, c), strlen(PQfname(row, c)));
+
+  for (r = 0; r < pl->nsample; r++)
+  {
+    for (t = 0; t < PQntuples(pl->sample[r]); t++)
+    {
+      for (c = 0; c < nfields; c++)
+      {
+        if (PQgetisnull(pl->sample[r], t, c))
+          continue;
+        resetPQExpBuffer(pl->cell);
+        append_binary_value(pl->cell, PQgetvalue(pl->sample[r], t, c),
+                            PQgetlength(pl->sample[r], t, c),
+                            PQftype(pl->sample[r], c));
+        pl->widths[c] = Max(pl->widths[c],
+                            display_width(pl->cell->data, pl->cell->len));
+      }
+    }
+  }
+}
+
+
+/*
+ * Append the header line of the output format
+ */
+static void
+format_header(PQExpBuffer out, report_pipeline *pl, const PGresult *row)
+{
+  int nfields = PQnfields(row);
+  int total;
+  int c;
+
+  if (pl->format == FORMAT_NDJSON)
+    return;
+
+  /* centered title, then the column names between rules */
+  if (pl->format == FORMAT_STREAMED)
+  {
+    for (c = 0, total = 1; c < nfields; c++)
+      total += pl->widths[c] + 3;
+    if (pl->aligned)
+      appendPQExpBuffer(out, "%*s%s\n",
+                        Max(total - display_width(pl->title, strlen(pl->title)), 0) / 2,
+                        "", pl->title);
+    else
+    {
+      append_padded(out, pl->title, strlen(pl->title),
+                    Max(total, display_width(pl->title, strlen(pl->title))), 'c');
+      appendPQExpBufferChar(out, '\n');
+    }
+    append_rule(out, pl, nfields);
+    for (c = 0; c < nfields; c++)
+    {
+      appendPQExpBufferStr(out, "| ");
+      append_padded(out, PQfname(row, c), strlen(PQfname(row, c)),
+                    pl->widths[c], 'c');
+      appendPQExpBufferChar(out, ' ');
+    }
+    appendPQExpBufferStr(out, "|\n");
+    append_rule(out, pl, nfields);
+    return;
+  }
+
+  for (c = 0; c < nfields; c++)
+  {
+    const char *name = PQfname(row, c);
+
+    switch (pl->format)
+    {
+      case FORMAT_CSV:
+        if (c > 0)
+          appendPQExpBufferChar(out, ',');
+        append_csv(out, name, strlen(name));
+        break;
+      case FORMAT_TSV:
+        if (c > 0)
+          appendPQExpBufferChar(out, '\t');
+        append_tsv(out, name, strlen(name));
+        break;
+      default:
+        if (c > 0)
+          appendPQExpBufferChar(out, '|');
+        appendPQExpBufferStr(out, name);
+        break;
+    }
+  }
+  appendPQExpBufferChar(out, '\n');
+}
+
+
+/*
+ * Append one row in the output format
+ *
+ * Values are written straight from the result into the output buffer.
+ * tuple is the row number within the result.
+ * Only text values may need quoting or escaping; the other types never
+ * contain separators.
+ */
+static void
+format_row(PQExpBuffer out, report_pipeline *pl, const PGresult *row,
+           int tuple)
+{
+  int        nfields = PQnfields(row);
+  int        c;
+  Oid        type;
+  const char *v;
+  int        len;
+  bool       text;
+
+  if (pl->format == FORMAT_NDJSON)
+    appendPQExpBufferChar(out, '{');
+
+  for (c = 0; c < nfields; c++)
+  {
+    type = PQftype(row, c);
+    v = PQgetvalue(row, tuple, c);
+    len = PQgetlength(row, tuple, c);
+    text = type == TEXTOID || type == VARCHAROID || type == BPCHAROID
+           || type == NAMEOID;
+
+    switch (pl->format)
+    {
+      case FORMAT_CSV:
+        if (c > 0)
+          appendPQExpBufferChar(out, ',');
+        if (PQgetisnull(row, tuple, c))
+          break;
+        if (text)
+          append_csv(out, v, len);
+        else
+          append_binary_value(out, v, len, type);
+        break;
+
+      case FORMAT_TSV:
+        if (c > 0)
+          appendPQExpBufferChar(out, '\t');
+        if (PQgetisnull(row, tuple, c))
+          appendPQExpBufferStr(out, "\\N");
+        else if (text)
+          append_tsv(out, v, len);
+        else
+          append_binary_value(out, v, len, type);
+        break;
+
+      case FORMAT_NDJSON:
+        if (c > 0)
+          appendPQExpBufferChar(out, ',');
+        append_json_string(out, PQfname(row, c), strlen(PQfname(row, c)));
+        appendPQExpBufferChar(out, ':');
+        if (PQgetisnull(row, tuple, c))
+          appendPQExpBufferStr(out, "null");
+        else if (type == BOOLOID)
+          appendPQExpBufferStr(out, *v ? "true" : "false");
+        else if (type == INT2OID || type == INT4OID || type == INT8OID
+                 || (type == NUMERICOID
+                     && (pg_ntoh16(*(uint16 *) (v + 4)) & 0x8000) == 0))
+          append_binary_value(out, v, len, type);
+        else if (text)
+          append_json_string(out, v, len);
+        else
+        {
+          /* dates, times and special numbers never need escaping */
+          appendPQExpBufferChar(out, '"');
+          append_binary_value(out, v, len, type);
+          appendPQExpBufferChar(out, '"');
+        }
+        break;
+
+      case FORMAT_STREAMED:
+        appendPQExpBufferStr(out, "| ");
+        resetPQExpBuffer(pl->cell);
+        if (!PQgetisnull(row, tuple, c))
+          append_binary_value(pl->cell, v, len, type);
+        append_padded(out, pl->cell->data, pl->cell->len, pl->widths[c],
+                      column_type_alignment(type));
+        appendPQExpBufferChar(out, ' ');
+        break;
+
+      default:
+        if (c > 0)
+          appendPQExpBufferChar(out, '|');
+        if (!PQgetisnull(row, tuple, c))
+          append_binary_value(out, v, len, type);
+        break;
+    }
+  }
+
+  if (pl->format == FORMAT_NDJSON)
+    appendPQExpBufferStr(out, "}\n");
+  else if (pl->format == FORMAT_STREAMED)
+    appendPQExpBufferStr(out, "|\n");
+  else
+    appendPQExpBufferChar(out, '\n');
+}
+
+
+/*
+ * Whether a result of a single-row or chunked query carries rows
+ */
+static bool
+is_row_result(const PGresult *res)
+{
+  switch (PQresultStatus(res))
+  {
+    case PGRES_SINGLE_TUPLE:
+    case PGRES_TUPLES_OK:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    case PGRES_TUPLES_CHUNK:
+#endif
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+/*
+ * Formatter stage: turn rows into output buffers
+ *
+ * Gets single-row or chunked results, ends with NULL, and hands over
+ * buffers of about CLIENTCOMPTAGE_OUTPUT_BUFFER_SIZE bytes to the writer.
+ */
+static void *
+pipeline_formatter(void *arg)
+{
+  report_pipeline *pl = (report_pipeline *) arg;
+  PQExpBuffer     out = createPQExpBuffer();
+  PGresult        *row;
+  PGresult        *last = NULL;
+  bool            header = true;
+  int             held = 0;
+  int             r;
+  int             t;
+
+  /* machine-readable formats have no title */
+  if (pl->format == FORMAT_UNALIGNED)
+    appendPQExpBuffer(out, "%s\n", pl->title);
+
+  while ((row = (PGresult *) spsc_pop(&pl->rows)) != NULL)
+  {
+    /*
+     * The streamed aligned format holds the first rows back until it
+     * knows how wide the columns are.
+     */
+    if (pl->format == FORMAT_STREAMED && !pl->widths)
+    {
+      if (PQntuples(row) > 0 && held < opts->sample_rows)
+      {
+        pl->sample[pl->nsample++] = row;
+        held += PQntuples(row);
+        continue;
+      }
+      sample_widths(pl, row);
+      format_header(out, pl, row);
+      header = false;
+      for (r = 0; r < pl->nsample; r++)
+      {
+        for (t = 0; t < PQntuples(pl->sample[r]); t++)
+          format_row(out, pl, pl->sample[r], t);
+        PQclear(pl->sample[r]);
+      }
+    }
+
+    if (header)
+    {
+      format_header(out, pl, row);
+      header = false;
+    }
+
+    for (t = 0; t < PQntuples(row); t++)
+      format_row(out, pl, row, t);
+
+    if (pl->format == FORMAT_STREAMED)
+    {
+      /* keep the last result to know the number of columns */
+      PQclear(last);
+      last = row;
+    }
+    else
+      PQclear(row);
+
+    if (out->len >= CLIENTCOMPTAGE_OUTPUT_BUFFER_SIZE)
+    {
+      spsc_push(&pl->buffers, out);
+      out = createPQExpBuffer();
+    }
+  }
+
+  if (pl->format == FORMAT_STREAMED)
+  {
+    /* the rows ended while still sampling */
+    if (!pl->widths && pl->nsample > 0)
+    {
+      sample_widths(pl, pl->sample[0]);
+      format_header(out, pl, pl->sample[0]);
+      header = false;
+      for (r = 0; r < pl->nsample; r++)
+      {
+        for (t = 0; t < PQntuples(pl->sample[r]); t++)
+          format_row(out, pl, pl->sample[r], t);
+        PQclear(last);
+        last = pl->sample[r];
+      }
+    }
+    if (last && !header)
+      append_rule(out, pl, PQnfields(last));
+    PQclear(last);
+  }
+
+  spsc_push(&pl->buffers, out);
+  spsc_push(&pl->buffers, NULL);
+  return NULL;
+}
+
+
+/*
+ * Writer stage: write buffers to stdout, several at a time
+ */
+static void *
+pipeline_writer(void *arg)
+{
+  report_pipeline *pl = (report_pipeline *) arg;
+  PQExpBuffer     bufs[CLIENTCOMPTAGE_MAX_IOV];
+  struct iovec    iov[CLIENTCOMPTAGE_MAX_IOV];
+  int             n = 0;
+  int             first;
+  int             i;
+  bool            done = false;
+  ssize_t         written;
+
+  fflush(stdout);
+  while (!done)
+  {
+    /* wait for one buffer, then take whatever else is ready */
+    bufs[n] = (PQExpBuffer) spsc_pop(&pl->buffers);
+    done = bufs[n] == NULL;
+    if (!done)
+      n++;
+    while (!done && n < CLIENTCOMPTAGE_MAX_IOV
+           && atomic_load_explicit(&pl->buffers.head, memory_order_acquire)
+              != atomic_load_explicit(&pl->buffers.tail, memory_order_relaxed))
+    {
+      bufs[n] = (PQExpBuffer) spsc_pop(&pl->buffers);
+      done = bufs[n] == NULL;
+      if (!done)
+        n++;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      iov[i].iov_base = bufs[i]->data;
+      iov[i].iov_len = bufs[i]->len;
+    }
+
+    /* writev() may write less than asked */
+    first = 0;
+    while (first < n)
+    {
+      written = writev(STDOUT_FILENO, iov + first, n - first);
+      if (written < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        pg_log_error("could not write output: %m");
+        exit(EXIT_FAILURE);
+      }
+      while (first < n && (size_t) written >= iov[first].iov_len)
+        written -= iov[first++].iov_len;
+      if (first < n)
+      {
+        iov[first].iov_base = (char *) iov[first].iov_base + written;
+        iov[first].iov_len -= written;
+      }
+    }
+
+    for (i = 0; i < n; i++)
+      destroyPQExpBuffer(bufs[i]);
+    n = 0;
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Ask the server for the widths of the columns of a query
+ *
+ * The query is only described, then a single aggregate query computes
+ * the longest text value of each column.
+ */
+static int *
+server_widths(const char *query, int nparams, const char *const *values)
+{
+  PQExpBufferData sql;
+  PGresult        *desc;
+  PGresult        *res;
+  char            *ident;
+  int             *widths;
+  int             nfields;
+  int             c;
+
+  desc = PQprepare(conn, "", query, nparams, NULL);
+  if (PQresultStatus(desc) == PGRES_COMMAND_OK)
+  {
+    PQclear(desc);
+    desc = PQdescribePrepared(conn, "");
+  }
+  if (PQresultStatus(desc) != PGRES_COMMAND_OK)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", query);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  nfields = PQnfields(desc);
+  widths = (int *) pg_malloc0(Max(nfields, 1) * sizeof(int));
+
+  initPQExpBuffer(&sql);
+  appendPQExpBufferStr(&sql, "SELECT ");
+  for (c = 0; c < nfields; c++)
+  {
+    ident = PQescapeIdentifier(conn, PQfname(desc, c), strlen(PQfname(desc, c)));
+    appendPQExpBuffer(&sql, "%scoalesce(max(length(q.%s::text)), 0)",
+                      c > 0 ? ", " : "", ident);
+    PQfreemem(ident);
+    widths[c] = display_width(PQfname(desc, c), strlen(PQfname(desc, c)));
+  }
+  appendPQExpBuffer(&sql, " FROM (%s) q", query);
+
+  res = run_query(sql.data, nparams, values, 0);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql.data);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  for (c = 0; c < nfields; c++)
+    widths[c] = Max(widths[c], atoi(PQgetvalue(res, 0, c)));
+
+  PQclear(res);
+  PQclear(desc);
+  termPQExpBuffer(&sql);
+  return widths;
+}
+
+
+/*
+ * Run a report through a fetch, format and write pipeline
+ *
+ * This thread fetches rows one at a time, while a formatter thread turns
+ * them into output buffers and a writer thread writes them, so that the
+ * network, the formatting and the output overlap.
+ */
+void
+stream_table(char *label, const char *query, int nparams,
+             const char *const *values)
+{
+  report_pipeline pl;
+  pthread_t       formatter;
+  pthread_t       writer;
+  PGresult        *res;
+  bool            failed = false;
+
+  spsc_init(&pl.rows, CLIENTCOMPTAGE_QUEUE_SIZE);
+  spsc_init(&pl.buffers, CLIENTCOMPTAGE_QUEUE_SIZE);
+  pl.title = label;
+  pl.widths = NULL;
+  pl.sample = NULL;
+  pl.nsample = 0;
+  pl.cell = createPQExpBuffer();
+  pl.format = opts->format;
+  pl.aligned = false;
+
+  if (pl.format == FORMAT_STREAMED)
+  {
+    if (opts->server_widths)
+      pl.widths = server_widths(query, nparams, values);
+    else
+      pl.sample = (PGresult **) pg_malloc(opts->sample_rows * sizeof(PGresult *));
+  }
+
+  /* rows come by chunks when the server and libpq allow it */
+  if (!PQsendQueryParams(conn, query, nparams, NULL, values, NULL, NULL, 1)
+#ifdef LIBPQ_HAS_CHUNK_MODE
+      || (caps.chunked_rows
+          ? !PQsetChunkedRowsMode(conn, CLIENTCOMPTAGE_CHUNK_ROWS)
+          : !PQsetSingleRowMode(conn)))
+#else
+      || !PQsetSingleRowMode(conn))
+#endif
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", query);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  if (pthread_create(&formatter, NULL, pipeline_formatter, &pl) != 0
+      || pthread_create(&writer, NULL, pipeline_writer, &pl) != 0)
+  {
+    pg_log_error("could not create pipeline threads");
+    exit(EXIT_FAILURE);
+  }
+
+  /* the final, empty, result carries the column names for empty reports */
+  while ((res = PQgetResult(conn)) != NULL)
+  {
+    mem_result(res);
+    if (is_row_result(res))
+      spsc_push(&pl.rows, res);
+    else
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      pg_log_info("query was: %s", query);
+      PQclear(res);
+      failed = true;
+    }
+  }
+  spsc_push(&pl.rows, NULL);
+
+  pthread_join(formatter, NULL);
+  pthread_join(writer, NULL);
+  spsc_destroy(&pl.rows);
+  spsc_destroy(&pl.buffers);
+  pg_free(pl.widths);
+  pg_free(pl.sample);
+  destroyPQExpBuffer(pl.cell);
+
+  if (failed)
+  {
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+/*
+ * Widen the columns of the streamed aligned format to fit a row
+ */
+static void
+update_widths(report_pipeline *pl, const PGresult *row)
+{
+  int c;
+
+  for (c = 0; c < PQnfields(row); c++)
+  {
+    if (PQntuples(row) == 0 || PQgetisnull(row, 0, c))
+      continue;
+    resetPQExpBuffer(pl->cell);
+    append_binary_value(pl->cell, PQgetvalue(row, 0, c),
+                        PQgetlength(row, 0, c), PQftype(row, c));
+    pl->widths[c] = Max(pl->widths[c],
+                        display_width(pl->cell->data, pl->cell->len));
+  }
+}
+
+
+/*
+ * Append a row to the spill file
+ *
+ * Each value is its length as an int32, -1 for null, then its binary
+ * representation.
+ */
+static void
+spill_row(FILE *spill, const PGresult *row)
+{
+  int32 len;
+  int   c;
+
+  for (c = 0; c < PQnfields(row); c++)
+  {
+    len = PQgetisnull(row, 0, c) ? -1 : PQgetlength(row, 0, c);
+    if (fwrite(&len, sizeof(len), 1, spill) != 1
+        || (len > 0 && fwrite(PQgetvalue(row, 0, c), len, 1, spill) != 1))
+    {
+      pg_log_error("could not write temporary file: %m");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+
+/*
+ * Read back a row of the spill file, as a result with the columns of attrs
+ */
+static PGresult *
+unspill_row(FILE *spill, const PGresult *attrs, PQExpBuffer data)
+{
+  PGresult *row = PQcopyResult(attrs, PG_COPYRES_ATTRS);
+  int32    len;
+  int      c;
+
+  for (c = 0; c < PQnfields(attrs); c++)
+  {
+    resetPQExpBuffer(data);
+    if (fread(&len, sizeof(len), 1, spill) != 1)
+    {
+      pg_log_error("could not read temporary file: %m");
+      exit(EXIT_FAILURE);
+    }
+    if (len > 0)
+    {
+      enlargePQExpBuffer(data, len);
+      if (fread(data->data, len, 1, spill) != 1)
+      {
+        pg_log_error("could not read temporary file: %m");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (!PQsetvalue(row, 0, c, len < 0 ? NULL : data->data, len))
+    {
+      pg_log_error("out of memory");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return row;
+}
+
+
+/*
+ * Run a report within --max-memory
+ *
+ * Rows are fetched one at a time and kept in memory while the budget
+ * allows it, the following ones go to a temporary file. As every row is
+ * seen before printing, the report is then rendered with exact column
+ * widths, from memory and then from disk, in the same layout as
+ * printTable gives the other aligned reports.
+ */
+void
+spill_table(char *label, const char *query, int nparams,
+            const char *const *values)
+{
+  report_pipeline pl;
+  PGresult        *res;
+  PGresult        *attrs = NULL;
+  PGresult        **rows = NULL;
+  PQExpBuffer     out;
+  FILE            *spill = NULL;
+  size_t          budget = (size_t) opts->max_memory * 1024 * 1024;
+  size_t          used = 0;
+  int64           nrows = 0;
+  int64           capacity = 0;
+  int64           nspilled = 0;
+  int64           i;
+  int             c;
+
+  atomic_store(&mem_phase, PHASE_QUERY);
+
+  if (!PQsendQueryParams(conn, query, nparams, NULL, values, NULL, NULL, 1)
+      || !PQsetSingleRowMode(conn))
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", query);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  pl.title = label;
+  pl.widths = NULL;
+  pl.cell = createPQExpBuffer();
+
+  while ((res = PQgetResult(conn)) != NULL)
+  {
+    mem_result(res);
+    if (PQresultStatus(res) != PGRES_SINGLE_TUPLE
+        && PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      pg_log_info("query was: %s", query);
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+
+    /* the first result gives the columns */
+    if (!attrs)
+    {
+      attrs = PQcopyResult(res, PG_COPYRES_ATTRS);
+      pl.widths = (int *) pg_malloc0(Max(PQnfields(res), 1) * sizeof(int));
+      for (c = 0; c < PQnfields(res); c++)
+        pl.widths[c] = display_width(PQfname(res, c), strlen(PQfname(res, c)));
+    }
+
+    if (PQntuples(res) == 0)
+    {
+      PQclear(res);
+      continue;
+    }
+
+    update_widths(&pl, res);
+
+    used += PQresultMemorySize(res) + sizeof(PGresult *);
+    if (!spill && used <= budget)
+    {
+      if (nrows == capacity)
+      {
+        capacity = Max(capacity * 2, 1024);
+        rows = (PGresult **) pg_realloc(rows, capacity * sizeof(PGresult *));
+      }
+      rows[nrows++] = res;
+      continue;
+    }
+
+    if (!spill && (spill = tmpfile()) == NULL)
+    {
+      pg_log_error("could not create temporary file: %m");
+      exit(EXIT_FAILURE);
+    }
+    spill_row(spill, res);
+    nspilled++;
+    PQclear(res);
+  }
+
+  if (opts->verbose && nspilled > 0)
+    pg_log_info(INT64_FORMAT " rows kept in memory, " INT64_FORMAT
+                " rows written to a temporary file", nrows, nspilled);
+
+  /* render like printTable, through the streamed format */
+  atomic_store(&mem_phase, PHASE_PRINT);
+  pl.format = FORMAT_STREAMED;
+  pl.aligned = true;
+  out = createPQExpBuffer();
+  format_header(out, &pl, attrs);
+
+  for (i = 0; i < nrows; i++)
+  {
+    format_row(out, &pl, rows[i], 0);
+    PQclear(rows[i]);
+    if (out->len >= CLIENTCOMPTAGE_OUTPUT_BUFFER_SIZE)
+    {
+      fwrite(out->data, 1, out->len, stdout);
+      resetPQExpBuffer(out);
+    }
+  }
+
+  if (spill)
+  {
+    PQExpBuffer data = createPQExpBuffer();
+
+    rewind(spill);
+    for (i = 0; i < nspilled; i++)
+    {
+      res = unspill_row(spill, attrs, data);
+      format_row(out, &pl, res, 0);
+      PQclear(res);
+      if (out->len >= CLIENTCOMPTAGE_OUTPUT_BUFFER_SIZE)
+      {
+        fwrite(out->data, 1, out->len, stdout);
+        resetPQExpBuffer(out);
+      }
+    }
+    destroyPQExpBuffer(data);
+    fclose(spill);
+  }
+
+  append_rule(out, &pl, PQnfields(attrs));
+  appendPQExpBufferChar(out, '\n');
+  fwrite(out->data, 1, out->len, stdout);
+  fflush(stdout);
+
+  destroyPQExpBuffer(out);
+  destroyPQExpBuffer(pl.cell);
+  pg_free(pl.widths);
+  pg_free(rows);
+  PQclear(attrs);
+}
+
+
+/*
+ * Find the next field or line delimiter, one byte at a time
+ *
+ * Returns end if there is none.
+ */
+static const char *
+find_delimiter_scalar(const char *p, const char *end)
+{
+  while (p < end && *p != ',' && *p != '\n')
+    p++;
+  return p;
+}
+
+
+#if defined(__x86_64__)
+/*
+ * Find the next field or line delimiter, 16 bytes at a time
+ */
+static const char *
+find_delimiter_sse2(const char *p, const char *end)
+{
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i newline = _mm_set1_epi8('\n');
+  __m128i       chunk;
+  int           mask;
+
+  while (end - p >= 16)
+  {
+    chunk = _mm_loadu_si128((const __m128i *) p);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, comma),
+                                          _mm_cmpeq_epi8(chunk, newline)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return find_delimiter_scalar(p, end);
+}
+
+
+/*
+ * Find the next field or line delimiter, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+static const char *
+find_delimiter_avx2(const char *p, const char *end)
+{
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  __m256i       chunk;
+  uint32        mask;
+
+  while (end - p >= 32)
+  {
+    chunk = _mm256_loadu_si256((const __m256i *) p);
+    mask = (uint32) _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(chunk, comma),
+                      _mm256_cmpeq_epi8(chunk, newline)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return find_delimiter_sse2(p, end);
+}
+#endif
+
+
+/*
+ * Choose the fastest delimiter scanner for this CPU
+ */
+void
+init_parser(void)
+{
+  find_delimiter = find_delimiter_scalar;
+#if defined(__x86_64__)
+  find_delimiter = find_delimiter_sse2;
+  if (__builtin_cpu_supports("avx2"))
+    find_delimiter = find_delimiter_avx2;
+#endif
+}
+
+
+/*
+ * Number of days of a month, in the proleptic Gregorian calendar
+ */
+static int
+days_in_month(int y, int m)
+{
+  static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+  if (m == 2 && y % 4 == 0 && (y % 100 != 0 || y % 400 == 0))
+    return 29;
+  return days[m - 1];
+}
+
+
+/*
+ * Number of days between 1970-01-01 and the given proleptic Gregorian date
+ */
+static int64
+days_from_civil(int y, int m, int d)
+{
+  int64 era;
+  int   yoe;
+  int   doy;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+
+/*
+ * UTC offset, in seconds, of a local time without explicit zone
+ *
+ * Resolved with mktime() for the local timezone (TZ), and cached per
+ * hour as imports are mostly sorted.
+ */
+static int64
+local_offset(int64 local_secs)
+{
+  static __thread int64 cached_hour = PG_INT64_MIN;
+  static __thread int64 cached_offset = 0;
+  struct tm tm;
+  time_t    t;
+  int64     hour = local_secs / 3600;
+
+  if (hour != cached_hour)
+  {
+    t = (time_t) local_secs;
+    gmtime_r(&t, &tm);
+    tm.tm_isdst = -1;
+    cached_offset = local_secs - (int64) mktime(&tm);
+    cached_hour = hour;
+  }
+  return cached_offset;
+}
+
+
+/*
+ * UTC offset, in seconds, of the local timezone at a given time
+ *
+ * Cached per hour, as callers mostly walk through sorted times.
+ */
+static int64
+utc_offset(int64 utc_secs)
+{
+  static __thread int64 cached_hour = PG_INT64_MIN;
+  static __thread int64 cached_offset = 0;
+  struct tm tm;
+  time_t    t;
+  int64     hour = utc_secs / 3600 - (utc_secs % 3600 < 0);
+
+  if (hour != cached_hour)
+  {
+    t = (time_t) (hour * 3600);
+    localtime_r(&t, &tm);
+    cached_offset = tm.tm_gmtoff;
+    cached_hour = hour;
+  }
+  return cached_offset;
+}
+
+
+/*
+ * Parse an ISO-8601 timestamp into microseconds since the Unix epoch
+ *
+ * Accepts "YYYY-MM-DD[ T]HH:MM[:SS[.ffffff]][Z|+HH[:MM]|-HH[:MM]]",
+ * optionally surrounded by spaces or double quotes. Timestamps without
+ * zone are read in the local timezone.
+ */
+bool
+parse_timestamp(const char *p, const char *end, int64 *result)
+{
+  int   f[6] = {0, 0, 0, 0, 0, 0};
+  int   widths[6] = {4, 2, 2, 2, 2, 2};
+  char  seps[6] = {'-', '-', 0, ':', 0, 0};
+  int64 usecs = 0;
+  int64 secs;
+  int64 offset = 0;
+  bool  has_zone = false;
+  int   scale;
+  int   sign;
+  int   i;
+  int   j;
+
+  while (p < end && (*p == ' ' || *p == '"'))
+    p++;
+  while (end > p && (end[-1] == ' ' || end[-1] == '"' || end[-1] == '\r'))
+    end--;
+
+  for (i = 0; i < 6; i++)
+  {
+    /* seconds are optional */
+    if (i == 5)
+    {
+      if (p >= end || *p != ':')
+        break;
+      p++;
+    }
+    if (i == 3)
+    {
+      if (p >= end || (*p != ' ' && *p != 'T'))
+        return false;
+      p++;
+    }
+
+    if (end - p < widths[i])
+      return false;
+    for (j = 0; j < widths[i]; j++)
+    {
+      if ((unsigned) (p[j] - '0') > 9)
+        return false;
+      f[i] = f[i] * 10 + (p[j] - '0');
+    }
+    p += widths[i];
+
+    if (seps[i] && (p >= end || *p++ != seps[i]))
+      return false;
+  }
+
+  /* what the server accepts: 24:00:00 is the end of the day */
+  if (f[1] < 1 || f[1] > 12 || f[2] < 1 || f[2] > days_in_month(f[0], f[1])
+      || f[3] > 24 || f[4] > 59 || f[5] > 60
+      || (f[3] == 24 && (f[4] != 0 || f[5] != 0)))
+    return false;
+
+  /* fractional seconds, to the microsecond */
+  if (p < end && *p == '.')
+  {
+    p++;
+    for (scale = 100000; p < end && (unsigned) (*p - '0') <= 9; p++)
+    {
+      usecs += (*p - '0') * scale;
+      scale /= 10;
+    }
+    if (f[3] == 24 && usecs != 0)
+      return false;
+  }
+
+  /* zone */
+  if (p < end && *p == 'Z')
+  {
+    has_zone = true;
+    p++;
+  }
+  else if (p < end && (*p == '+' || *p == '-'))
+  {
+    sign = *p++ == '-' ? -1 : 1;
+    for (i = 0; i < 2 && p < end; i++)
+    {
+      if (i == 1 && *p == ':')
+        p++;
+      if (end - p < 2 || (unsigned) (p[0] - '0') > 9
+          || (unsigned) (p[1] - '0') > 9)
+        break;
+      offset += ((p[0] - '0') * 10 + (p[1] - '0')) * (i == 0 ? 3600 : 60);
+      p += 2;
+    }
+    if (i == 0)
+      return false;
+    offset *= sign;
+    has_zone = true;
+  }
+
+  if (p != end)
+    return false;
+
+  secs = days_from_civil(f[0], f[1], f[2]) * SECS_PER_DAY
+         + f[3] * 3600 + f[4] * 60 + f[5];
+  if (!has_zone)
+    offset = local_offset(secs);
+
+  *result = (secs - offset) * USECS_PER_SEC + usecs;
+  return true;
+}
+
+
+/*
+ * Parse a "deb,fin" line, without its end of line
+ */
+bool
+parse_row(const char *p, const char *end, int64 *deb, int64 *fin)
+{
+  const char *comma;
+
+  comma = find_delimiter(p, end);
+  if (comma == end || *comma != ',')
+    return false;
+  if (find_delimiter(comma + 1, end) != end)
+    return false;
+
+  return parse_timestamp(p, comma, deb) && parse_timestamp(comma + 1, end, fin);
+}
+
+
+/*
+ * Initialize the event ring
+ *
+ * size must be a power of two.
+ */
+void
+ring_init(event_ring *r, size_t size)
+{
+  size_t i;
+
+  r->slots = (ring_slot *) pg_malloc(size * sizeof(ring_slot));
+  for (i = 0; i < size; i++)
+    atomic_init(&r->slots[i].sequence, i);
+  r->mask = size - 1;
+  atomic_init(&r->head, 0);
+  r->tail = 0;
+  atomic_init(&r->sleepers, 0);
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+}
+
+
+/*
+ * Push an event into the ring, from any thread
+ *
+ * Returns false if the ring is full. Never blocks.
+ */
+bool
+ring_push(event_ring *r, const char *event, size_t len)
+{
+  ring_slot *slot;
+  size_t    pos;
+  size_t    seq;
+  intptr_t  diff;
+
+  pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+  for (;;)
+  {
+    slot = &r->slots[pos & r->mask];
+    seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    diff = (intptr_t) seq - (intptr_t) pos;
+
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+      return false;
+    else
+      pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+  }
+
+  memcpy(slot->data, event, len);
+  slot->data[len] = '\0';
+  atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+  return true;
+}
+
+
+/*
+ * Push an event into the ring, waiting while it is full
+ *
+ * Yields a few times first, then sleeps until the consumer frees slots.
+ */
+void
+ring_push_wait(event_ring *r, const char *event, size_t len)
+{
+  int spins = 0;
+
+  while (!ring_push(r, event, len))
+  {
+    if (++spins < CLIENTCOMPTAGE_SPIN_LIMIT)
+    {
+      sched_yield();
+      continue;
+    }
+    pthread_mutex_lock(&r->lock);
+    atomic_fetch_add(&r->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!ring_push(r, event, len))
+      pthread_cond_wait(&r->cond, &r->lock);
+    atomic_fetch_sub(&r->sleepers, 1);
+    pthread_mutex_unlock(&r->lock);
+    return;
+  }
+}
+
+
+/*
+ * Wake the producers sleeping on a full ring, from the consumer
+ */
+void
+ring_wake(event_ring *r)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&r->sleepers) > 0)
+  {
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+
+/*
+ * Pop an event from the ring, from the single consumer thread
+ *
+ * Returns false if the ring is empty.
+ */
+bool
+ring_pop(event_ring *r, char *event)
+{
+  ring_slot *slot;
+
+  slot = &r->slots[r->tail & r->mask];
+  if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != r->tail + 1)
+    return false;
+
+  strcpy(event, slot->data);
+  atomic_store_explicit(&slot->sequence, r->tail + r->mask + 1,
+                        memory_order_release);
+  r->tail++;
+
+  return true;
+}
+
+
+/*
+ * Read events from a client of the daemon socket
+ *
+ * One event per line, "deb,fin". Readers only ever touch the ring, so a
+ * slow database never blocks them; a full ring makes them wait. The
+ * socket is closed by the main thread, once the reader is joined.
+ */
+static void *
+daemon_reader(void *arg)
+{
+  daemon_client *client = (daemon_client *) arg;
+  int     fd = client->fd;
+  char    buf[8192];
+  size_t  used = 0;
+  ssize_t n;
+  char    *line;
+  char    *eol;
+  size_t  len;
+  int64   deb;
+  int64   fin;
+
+  for (;;)
+  {
+    n = read(fd, buf + used, sizeof(buf) - used);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    used += n;
+    line = buf;
+    while ((eol = memchr(line, '\n', used - (line - buf))) != NULL)
+    {
+      len = eol - line;
+      if (len > 0 && line[len - 1] == '\r')
+        len--;
+
+      if (len >= CLIENTCOMPTAGE_EVENT_SIZE)
+        pg_log_warning("event too long, ignored");
+      else if (len > 0 && !parse_row(line, line + len, &deb, &fin))
+        pg_log_warning("invalid event \"%.*s\", ignored", (int) len, line);
+      else if (len > 0)
+        ring_push_wait(&ring, line, len);
+      line = eol + 1;
+    }
+
+    /* keep the incomplete line for the next read */
+    used -= line - buf;
+    memmove(buf, line, used);
+    if (used == sizeof(buf))
+    {
+      pg_log_warning("event too long, connection closed");
+      break;
+    }
+  }
+
+  atomic_store(&client->done, true);
+  return NULL;
+}
+
+
+/*
+ * Send a batch of events, through a temporary staging table
+ *
+ * Each line of the batch already carries its entry key, so the whole
+ * batch can be replayed after a connection loss without duplicates.
+ * Tells a batch the server rejected from one it could not reach.
+ */
+static batch_status_t
+flush_batch(PQExpBuffer batch)
+{
+  PGresult *res;
+  PGresult *next;
+  bool      copied;
+  int       attempt;
+
+  for (attempt = 0;; attempt++)
+  {
+    res = PQexec(conn,
+      "CREATE TEMP TABLE IF NOT EXISTS comptage_lot "
+      "(deb timestamptz, fin timestamptz, cle text);"
+      "COPY comptage_lot FROM STDIN (FORMAT csv)");
+
+    if (PQresultStatus(res) == PGRES_COPY_IN)
+    {
+      PQclear(res);
+      copied = PQputCopyData(conn, batch->data, batch->len) == 1
+               && PQputCopyEnd(conn, NULL) == 1;
+      res = PQgetResult(conn);
+      copied = copied && PQresultStatus(res) == PGRES_COMMAND_OK;
+      while ((next = PQgetResult(conn)) != NULL)
+        PQclear(next);
+
+      if (copied)
+      {
+        /*
+         * Without a conflict target, DO NOTHING also skips the events
+         * refused by the exclusion constraint instead of failing the
+         * whole batch. The outer query still sees the table as before
+         * the insert: events neither inserted nor already there by key
+         * were refused as overlaps.
+         */
+        PQclear(res);
+        res = PQexec(conn,
+          "WITH ins AS (INSERT INTO public.comptage (deb,fin,cle) "
+          "SELECT deb, fin, cle FROM comptage_lot "
+          "ON CONFLICT DO NOTHING RETURNING cle) "
+          "SELECT l.deb, l.fin FROM comptage_lot l "
+          "WHERE NOT EXISTS (SELECT 1 FROM ins WHERE ins.cle = l.cle) "
+          "AND NOT EXISTS (SELECT 1 FROM public.comptage c WHERE c.cle = l.cle)");
+        if (PQresultStatus(res) == PGRES_TUPLES_OK)
+        {
+          int i;
+
+          for (i = 0; i < PQntuples(res); i++)
+            pg_log_warning("event %s,%s overlaps an existing entry, rejected",
+                           PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
+          PQclear(res);
+          res = PQexec(conn, "TRUNCATE comptage_lot");
+        }
+      }
+    }
+
+    if (PQresultStatus(res) == PGRES_COMMAND_OK)
+    {
+      PQclear(res);
+      return BATCH_SENT;
+    }
+
+    if (PQstatus(conn) != CONNECTION_BAD)
+    {
+      pg_log_warning("batch rejected: %s", PQerrorMessage(conn));
+      PQclear(res);
+      PQclear(PQexec(conn, "TRUNCATE comptage_lot"));
+      return BATCH_REJECTED;
+    }
+
+    PQclear(res);
+    if (attempt >= CLIENTCOMPTAGE_MAX_RETRIES)
+    {
+      pg_log_error("connection lost, batch not sent");
+      return BATCH_NOT_SENT;
+    }
+
+    pg_log_warning("connection lost, retrying batch (%d/%d)",
+                   attempt + 1, CLIENTCOMPTAGE_MAX_RETRIES);
+    retry_delay(attempt);
+    PQreset(conn);
+  }
+}
+
+
+/*
+ * Append events to a file, and flush it to disk
+ */
+static bool
+write_events(const char *path, PQExpBuffer events)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (fd < 0
+      || write(fd, events->data, events->len) != (ssize_t) events->len
+      || fsync(fd) != 0)
+  {
+    pg_log_error("could not write events to \"%s\": %m", path);
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+
+/*
+ * Append a batch that could not be sent to the pending file
+ *
+ * The events keep their keys, so sending them again later can never
+ * add an entry twice. Returns false if the file could not be written.
+ */
+static bool
+spill_batch(PQExpBuffer batch)
+{
+  if (!write_events(opts->pending_file, batch))
+    return false;
+
+  pg_log_warning("batch kept in \"%s\", it will be sent again",
+                 opts->pending_file);
+  return true;
+}
+
+
+/*
+ * Send a batch, one event at a time if the server rejects it
+ *
+ * The events the server rejects on their own go to the rejected file, so
+ * that a bad event never holds back the others. Returns false if the
+ * server could not be reached: the events not sent yet are then left in
+ * the batch.
+ */
+static bool
+send_batch(PQExpBuffer batch)
+{
+  PQExpBuffer    one;
+  batch_status_t status;
+  char           *line;
+  char           *end;
+  char           *stop = batch->data + batch->len;
+
+  status = flush_batch(batch);
+  if (status != BATCH_REJECTED)
+    return status == BATCH_SENT;
+
+  one = createPQExpBuffer();
+  for (line = batch->data; line < stop; line = end)
+  {
+    end = memchr(line, '\n', stop - line);
+    end = end ? end + 1 : stop;
+    resetPQExpBuffer(one);
+    appendBinaryPQExpBuffer(one, line, end - line);
+
+    status = flush_batch(one);
+    if (status == BATCH_NOT_SENT)
+      break;
+    if (status == BATCH_REJECTED)
+    {
+      if (!write_events(opts->rejected_file, one))
+        break;
+      pg_log_warning("event %.*s kept in \"%s\"",
+                     (int) (end - line - 1), line, opts->rejected_file);
+    }
+  }
+  destroyPQExpBuffer(one);
+
+  /* what is left could not be sent */
+  batch->len = stop - line;
+  memmove(batch->data, line, batch->len);
+  batch->data[batch->len] = '\0';
+  return batch->len == 0;
+}
+
+
+/*
+ * Send the events of the pending file again, and remove it once they
+ * are in
+ */
+static bool
+flush_pending(void)
+{
+  PQExpBuffer pending;
+  char        buf[8192];
+  char        tmpfile[MAXPGPATH];
+  ssize_t     n;
+  size_t      size;
+  bool        sent;
+  int         fd;
+
+  fd = open(opts->pending_file, O_RDONLY);
+  if (fd < 0)
+    return errno == ENOENT;
+
+  pending = createPQExpBuffer();
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    appendBinaryPQExpBuffer(pending, buf, n);
+  close(fd);
+
+  if (n != 0)
+  {
+    destroyPQExpBuffer(pending);
+    return false;
+  }
+
+  size = pending->len;
+  sent = size == 0 || send_batch(pending);
+  if (sent)
+  {
+    unlink(opts->pending_file);
+    if (opts->verbose && size > 0)
+      pg_log_info("pending events from \"%s\" sent", opts->pending_file);
+  }
+  else if (pending->len < size)
+  {
+    /* only keep the events that were not sent */
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", opts->pending_file);
+    unlink(tmpfile);
+    if (write_events(tmpfile, pending))
+      rename(tmpfile, opts->pending_file);
+  }
+
+  destroyPQExpBuffer(pending);
+  return sent;
+}
+
+
+/*
+ * Drain the ring into batches
+ *
+ * A batch is sent as soon as it holds batch_size events, or when the
+ * first event it holds is older than batch_delay milliseconds. A batch
+ * that cannot reach the server goes to the pending file, which is sent
+ * again every few seconds; if even that fails, the batch is kept and the
+ * ring fills up, making the readers wait. Events the server rejects go
+ * to the rejected file. No event is ever dropped.
+ */
+static void *
+daemon_writer(void *arg)
+{
+  PQExpBuffer     batch;
+  char            event[CLIENTCOMPTAGE_EVENT_SIZE];
+  char            key[2 * CLIENTCOMPTAGE_KEY_SIZE + 1];
+  int             count = 0;
+  long            total = 0;
+  struct timespec now;
+  struct timespec deadline = {0, 0};
+  struct timespec pause = {0, 1000000};
+  time_t          last_pending = 0;
+  bool            pending = true;
+  bool            stopping;
+
+  batch = createPQExpBuffer();
+
+  for (;;)
+  {
+    stopping = atomic_load(&writer_stop);
+
+    /* older events first, when the server is back */
+    if (pending && time(NULL) - last_pending >= CLIENTCOMPTAGE_PENDING_RETRY)
+    {
+      pending = !flush_pending();
+      last_pending = time(NULL);
+    }
+
+    while (count < opts->batch_size && ring_pop(&ring, event))
+    {
+      if (count == 0)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += opts->batch_delay / 1000;
+        deadline.tv_nsec += (opts->batch_delay % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+        }
+      }
+      generate_entry_key(key);
+      appendPQExpBuffer(batch, "%s,%s\n", event, key);
+      count++;
+    }
+    ring_wake(&ring);
+
+    if (count > 0)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (count >= opts->batch_size || stopping
+          || now.tv_sec > deadline.tv_sec
+          || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+      {
+        if (!pending && send_batch(batch))
+        {
+          total += count;
+          if (opts->verbose)
+            pg_log_info("%d events sent (%ld total)", count, total);
+        }
+        else if (spill_batch(batch))
+          pending = true;
+        else
+        {
+          /* keep the batch, the ring holds the next events meanwhile */
+          sleep(1);
+          continue;
+        }
+        resetPQExpBuffer(batch);
+        count = 0;
+        continue;
+      }
+    }
+    else if (stopping)
+    {
+      if (pending && !flush_pending())
+        pg_log_warning("events left in \"%s\", sent at the next start",
+                       opts->pending_file);
+      break;
+    }
+
+    nanosleep(&pause, NULL);
+  }
+
+  destroyPQExpBuffer(batch);
+  return NULL;
+}
+
+
+/*
+ * Run the event ingestion daemon
+ */
+void
+run_daemon(void)
+{
+  struct sockaddr_un addr;
+  struct pollfd      pfd;
+  pthread_t          writer;
+  daemon_client      **clients = NULL;
+  daemon_client      *client;
+  int                nclients = 0;
+  int                capacity = 0;
+  int                sock;
+  int                fd;
+  int                i;
+
+  if (strlen(opts->socket_path) >= sizeof(addr.sun_path))
+  {
+    pg_log_error("socket path too long: %s", opts->socket_path);
+    exit(EXIT_FAILURE);
+  }
+
+  ring_init(&ring, CLIENTCOMPTAGE_RING_SIZE);
+  atomic_init(&daemon_stop, false);
+  atomic_init(&writer_stop, false);
+  opts->pending_file = arena_psprintf(&opts_arena, "%s.pending",
+                                      opts->socket_path);
+  opts->rejected_file = arena_psprintf(&opts_arena, "%s.rejected",
+                                       opts->socket_path);
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+  {
+    pg_log_error("could not create socket: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, opts->socket_path);
+  unlink(opts->socket_path);
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || listen(sock, SOMAXCONN) < 0)
+  {
+    pg_log_error("could not listen on \"%s\": %m", opts->socket_path);
+    exit(EXIT_FAILURE);
+  }
+
+  /* stop nicely, so that pending events are sent */
+  pqsignal(SIGINT, stop_daemon);
+  pqsignal(SIGTERM, stop_daemon);
+  pqsignal(SIGPIPE, SIG_IGN);
+
+  if (pthread_create(&writer, NULL, daemon_writer, NULL) != 0)
+  {
+    pg_log_error("could not create writer thread");
+    exit(EXIT_FAILURE);
+  }
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  while (!atomic_load(&daemon_stop))
+  {
+    /* join the readers whose client is gone */
+    for (i = 0; i < nclients; i++)
+      if (atomic_load(&clients[i]->done))
+      {
+        pthread_join(clients[i]->thread, NULL);
+        close(clients[i]->fd);
+        pg_free(clients[i]);
+        clients[i--] = clients[--nclients];
+      }
+
+    if (poll(&pfd, 1, 500) <= 0)
+      continue;
+
+    fd = accept(sock, NULL, NULL);
+    if (fd < 0)
+      continue;
+
+    if (nclients == capacity)
+    {
+      capacity = Max(capacity * 2, 16);
+      clients = (daemon_client **) pg_realloc(clients,
+                                              capacity * sizeof(daemon_client *));
+    }
+    client = (daemon_client *) pg_malloc(sizeof(daemon_client));
+    client->fd = fd;
+    atomic_init(&client->done, false);
+    if (pthread_create(&client->thread, NULL, daemon_reader, client) != 0)
+    {
+      pg_log_warning("could not create reader thread");
+      close(fd);
+      pg_free(client);
+      continue;
+    }
+    clients[nclients++] = client;
+  }
+
+  close(sock);
+  unlink(opts->socket_path);
+
+  /*
+   * Readers see the end of their socket, push what they already read,
+   * and only then does the writer do its last drain.
+   */
+  for (i = 0; i < nclients; i++)
+    shutdown(clients[i]->fd, SHUT_RD);
+  for (i = 0; i < nclients; i++)
+  {
+    pthread_join(clients[i]->thread, NULL);
+    close(clients[i]->fd);
+    pg_free(clients[i]);
+  }
+  pg_free(clients);
+
+  atomic_store(&writer_stop, true);
+  pthread_join(writer, NULL);
+}
+
+
+/*
+ * Ask the daemon to stop after sending pending events
+ */
+static void
+stop_daemon(SIGNAL_ARGS)
+{
+  atomic_store(&daemon_stop, true);
+}
+
+
+/*
+ * Seconds elapsed since start
+ */
+static double
+elapsed_since(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/*
+ * Load one slice of the input file into the staging table
+ */
+static void *
+import_chunk(void *arg)
+{
+  import_worker   *w = (import_worker *) arg;
+  PGresult        *res;
+  char            sql[CLIENTCOMPTAGE_DEFAULT_STRING_SIZE];
+  struct timespec start;
+  const char      *p = w->start;
+  const char      *end = w->start + w->len;
+  const char      *eol;
+  const char      *next;
+  char            *buf;
+  size_t          used;
+  int64           deb;
+  int64           fin;
+  uint16          i16;
+  uint32          i32;
+  uint64          i64;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  snprintf(sql, sizeof(sql), "COPY %s FROM STDIN (FORMAT binary)", w->table);
+  res = PQexec(w->conn, sql);
+  if (PQresultStatus(res) != PGRES_COPY_IN)
+    w->failed = true;
+  PQclear(res);
+
+  /* binary COPY header: signature, flags, header extension length */
+  buf = pg_malloc(CLIENTCOMPTAGE_COPY_CHUNK_SIZE);
+  memcpy(buf, "PGCOPY\n\377\r\n\0", 11);
+  memset(buf + 11, 0, 8);
+  used = 19;
+
+  /*
+   * Validate and convert each row, and send them as tuples of two
+   * timestamptz, in microseconds since 2000-01-01.
+   */
+  while (!w->failed && p < end)
+  {
+    eol = p;
+    do
+      eol = find_delimiter(eol, end);
+    while (eol < end && *eol++ != '\n');
+    next = eol;
+    if (eol > p && eol[-1] == '\n')
+      eol--;
+
+    if (eol > p && parse_row(p, eol, &deb, &fin))
+    {
+      if (used + 26 > CLIENTCOMPTAGE_COPY_CHUNK_SIZE)
+      {
+        if (PQputCopyData(w->conn, buf, used) != 1)
+          w->failed = true;
+        used = 0;
+      }
+      i16 = pg_hton16(2);
+      i32 = pg_hton32(8);
+      memcpy(buf + used, &i16, 2);
+      memcpy(buf + used + 2, &i32, 4);
+      i64 = pg_hton64(deb - POSTGRES_EPOCH_USECS);
+      memcpy(buf + used + 6, &i64, 8);
+      memcpy(buf + used + 14, &i32, 4);
+      i64 = pg_hton64(fin - POSTGRES_EPOCH_USECS);
+      memcpy(buf + used + 18, &i64, 8);
+      used += 26;
+    }
+    else if (eol > p)
+    {
+      pg_log_warning("worker %d: invalid row \"%.*s\", ignored",
+                     w->id, (int) Min(eol - p, 80), p);
+      w->rejected++;
+    }
+    p = next;
+    atomic_store(&w->sent, p - w->start);
+  }
+
+  /* trailer */
+  i16 = pg_hton16(-1);
+  memcpy(buf + used, &i16, 2);
+  used += 2;
+  if (!w->failed && PQputCopyData(w->conn, buf, used) != 1)
+    w->failed = true;
+  pg_free(buf);
+
+  if (!w->failed)
+  {
+    if (PQputCopyEnd(w->conn, NULL) != 1)
+      w->failed = true;
+    res = PQgetResult(w->conn);
+    if (PQresultStatus(res) == PGRES_COMMAND_OK)
+      w->rows = atol(PQcmdTuples(res));
+    else
+      w->failed = true;
+    PQclear(res);
+  }
+
+  if (w->failed)
+    pg_log_error("worker %d: %s", w->id, PQerrorMessage(w->conn));
+
+  w->elapsed = elapsed_since(&start);
+  atomic_store(&w->done, true);
+  return NULL;
+}
+
+
+/*
+ * Import a CSV file with several connections
+ *
+ * The file is split at line boundaries into one slice per job. Each
+ * slice is copied concurrently into an unlogged staging table, which is
+ * then merged into public.comptage with a single statement.
+ */
+void
+run_import(const ConnParams *cparams, const char *progname)
+{
+  import_worker   *workers;
+  pthread_t       *threads;
+  struct stat     st;
+  struct timespec start;
+  char            table[NAMEDATALEN];
+  char            sql[CLIENTCOMPTAGE_DEFAULT_STRING_SIZE];
+  const char      *data;
+  const char      *end;
+  const char      *pos;
+  const char      *eol;
+  PGresult        *res;
+  long            rows = 0;
+  bool            failed = false;
+  bool            running;
+  int             fd;
+  int             i;
+
+  fd = open(opts->import_file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    pg_log_error("could not open file \"%s\": %m", opts->import_file);
+    exit(EXIT_FAILURE);
+  }
+  if (st.st_size == 0)
+  {
+    close(fd);
+    return;
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    pg_log_error("could not map file \"%s\": %m", opts->import_file);
+    exit(EXIT_FAILURE);
+  }
+  madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+  end = data + st.st_size;
+
+  /* staging table, private to this import */
+  snprintf(table, sizeof(table), "public.comptage_import_%d", (int) getpid());
+  snprintf(sql, sizeof(sql),
+    "CREATE UNLOGGED TABLE %s (deb timestamptz, fin timestamptz)", table);
+  execute(sql);
+
+  /* split the file at line boundaries */
+  workers = (import_worker *) pg_malloc0(opts->jobs * sizeof(import_worker));
+  threads = (pthread_t *) pg_malloc(opts->jobs * sizeof(pthread_t));
+  pos = data;
+  for (i = 0; i < opts->jobs; i++)
+  {
+    import_worker *w = &workers[i];
+
+    w->id = i + 1;
+    w->table = table;
+    w->start = pos;
+    if (i == opts->jobs - 1)
+      pos = end;
+    else
+    {
+      pos = Max(pos, data + st.st_size / opts->jobs * (i + 1));
+      eol = pos < end ? memchr(pos, '\n', end - pos) : NULL;
+      pos = eol ? eol + 1 : end;
+    }
+    w->len = pos - w->start;
+    atomic_init(&w->sent, 0);
+    atomic_init(&w->done, false);
+    w->conn = connectDatabase(cparams, progname, false, false, true);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < opts->jobs; i++)
+  {
+    if (pthread_create(&threads[i], NULL, import_chunk, &workers[i]) != 0)
+    {
+      pg_log_error("could not create import thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* report progress until every worker is done */
+  do
+  {
+    pg_usleep(opts->verbose ? 1000000L : 100000L);
+    running = false;
+    for (i = 0; i < opts->jobs; i++)
+    {
+      import_worker *w = &workers[i];
+      size_t        sent = atomic_load(&w->sent);
+
+      if (!atomic_load(&w->done))
+        running = true;
+      if (opts->verbose)
+        pg_log_info("worker %d: %zu/%zu bytes, %.1f MB/s", w->id,
+                    sent, w->len, sent / 1048576.0 / elapsed_since(&start));
+    }
+  } while (running);
+
+  for (i = 0; i < opts->jobs; i++)
+  {
+    import_worker *w = &workers[i];
+
+    pthread_join(threads[i], NULL);
+    PQfinish(w->conn);
+    failed |= w->failed;
+    rows += w->rows;
+    printf("worker %d: %ld rows, %ld rejected, %zu bytes in %.2f s (%.1f MB/s)\n",
+           w->id, w->rows, w->rejected, w->len, w->elapsed,
+           w->elapsed > 0 ? w->len / 1048576.0 / w->elapsed : 0.0);
+  }
+
+  if (failed)
+  {
+    snprintf(sql, sizeof(sql), "DROP TABLE %s", table);
+    execute(sql);
+    pg_log_error("import failed, nothing was merged");
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+   * One set-based merge into the real table. Rows refused by the
+   * exclusion constraint are skipped rather than failing the merge.
+   */
+  res = PQexec(conn, "BEGIN");
+  if (PQresultStatus(res) == PGRES_COMMAND_OK)
+  {
+    PQclear(res);
+    snprintf(sql, sizeof(sql),
+      "INSERT INTO public.comptage (deb,fin) SELECT deb, fin FROM %s "
+      "ON CONFLICT DO NOTHING", table);
+    res = PQexec(conn, sql);
+  }
+  if (PQresultStatus(res) == PGRES_COMMAND_OK)
+  {
+    if (atol(PQcmdTuples(res)) < rows)
+      pg_log_warning("%ld rows overlap existing entries, rejected",
+                     rows - atol(PQcmdTuples(res)));
+    PQclear(res);
+    snprintf(sql, sizeof(sql), "DROP TABLE %s; COMMIT", table);
+    res = PQexec(conn, sql);
+  }
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+  {
+    pg_log_error("merge failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    PQclear(PQexec(conn, "ROLLBACK"));
+    snprintf(sql, sizeof(sql), "DROP TABLE %s", table);
+    execute(sql);
+    exit(EXIT_FAILURE);
+  }
+  PQclear(res);
+
+  printf("%ld rows imported in %.2f s\n", rows, elapsed_since(&start));
+
+  munmap((void *) data, st.st_size);
+  close(fd);
+  pg_free(workers);
+  pg_free(threads);
+}
+
+
+/*
+ * Append an unsigned varint, 7 bits per byte
+ */
+static uint8 *
+encode_varint(uint8 *p, uint64 v)
+{
+  while (v >= 0x80)
+  {
+    *p++ = (uint8) (v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8) v;
+  return p;
+}
+
+
+/*
+ * Read an unsigned varint, returns NULL if it is truncated
+ */
+static const uint8 *
+decode_varint(const uint8 *p, const uint8 *end, uint64 *v)
+{
+  int shift = 0;
+
+  *v = 0;
+  while (p < end && shift < 64)
+  {
+    *v |= (uint64) (*p & 0x7F) << shift;
+    if (!(*p++ & 0x80))
+      return p;
+    shift += 7;
+  }
+  return NULL;
+}
+
+
+/*
+ * Load the local replica in memory
+ *
+ * A missing file is an empty replica.
+ */
+void
+local_store_load(local_store *st)
+{
+  local_header hdr;
+  struct stat  sb;
+  const uint8  *data;
+  const uint8  *p;
+  const uint8  *end;
+  uint64       v;
+  int64        deb = 0;
+  int64        i;
+  int          fd;
+
+  memset(st, 0, sizeof(local_store));
+  st->watermark = PG_INT64_MIN;
+
+  fd = open(opts->local_file, O_RDONLY);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+      return;
+    pg_log_error("could not open file \"%s\": %m", opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+
+  /* magic and version first, older headers may be shorter */
+  if (fstat(fd, &sb) < 0
+      || sb.st_size < (off_t) offsetof(local_header, nrows))
+  {
+    pg_log_error("invalid local replica \"%s\"", opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+
+  data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    pg_log_error("could not map file \"%s\": %m", opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(&hdr, data, offsetof(local_header, nrows));
+  if (memcmp(hdr.magic, CLIENTCOMPTAGE_LOCAL_MAGIC, 4) != 0)
+  {
+    pg_log_error("invalid local replica \"%s\"", opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+  if (hdr.version != CLIENTCOMPTAGE_LOCAL_VERSION)
+  {
+    pg_log_error("local replica \"%s\" has an old format, remove it and run --sync",
+                 opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+
+  if (sb.st_size < (off_t) sizeof(hdr))
+  {
+    pg_log_error("invalid local replica \"%s\"", opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&hdr, data, sizeof(hdr));
+  if (hdr.nrows < 0 || hdr.deb_bytes < 0 || hdr.duration_bytes < 0
+      || hdr.nyears < 0
+      || (off_t) sizeof(hdr) + hdr.deb_bytes + hdr.duration_bytes
+         + (off_t) hdr.nyears * CLIENTCOMPTAGE_CALENDAR_WORDS * sizeof(uint64)
+         != sb.st_size)
+  {
+    pg_log_error("invalid local replica \"%s\"", opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+
+  st->nrows = st->capacity = hdr.nrows;
+  st->watermark = hdr.watermark;
+  st->lsn = hdr.lsn;
+  memcpy(st->timezone, hdr.timezone, sizeof(st->timezone));
+  st->timezone[sizeof(st->timezone) - 1] = '\0';
+  st->deb = (int64 *) pg_malloc(Max(st->capacity, 1) * sizeof(int64));
+  st->fin = (int64 *) pg_malloc(Max(st->capacity, 1) * sizeof(int64));
+
+  /* deb deltas, then durations */
+  p = data + sizeof(hdr);
+  end = p + hdr.deb_bytes;
+  for (i = 0; i < st->nrows; i++)
+  {
+    if (!(p = decode_varint(p, end, &v)))
+      break;
+    deb += UNZIGZAG(v);
+    st->deb[i] = deb;
+  }
+  end += hdr.duration_bytes;
+  for (i = 0; p && i < st->nrows; i++)
+  {
+    if (!(p = decode_varint(p, end, &v)))
+      break;
+    st->fin[i] = st->deb[i] + UNZIGZAG(v);
+  }
+  if (!p)
+  {
+    pg_log_error("truncated local replica \"%s\"", opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+
+  st->first_year = hdr.first_year;
+  st->nyears = hdr.nyears;
+  if (st->nyears > 0)
+  {
+    st->calendar = (uint64 *) pg_malloc(st->nyears * CLIENTCOMPTAGE_CALENDAR_WORDS
+                                        * sizeof(uint64));
+    memcpy(st->calendar, data + sizeof(hdr) + hdr.deb_bytes + hdr.duration_bytes,
+           st->nyears * CLIENTCOMPTAGE_CALENDAR_WORDS * sizeof(uint64));
+  }
+
+  munmap((void *) data, sb.st_size);
+  close(fd);
+}
+
+
+/*
+ * Write the local replica, atomically replacing the previous one
+ */
+void
+local_store_save(local_store *st)
+{
+  local_header hdr;
+  char         tmpfile[MAXPGPATH];
+  uint8        *buf;
+  uint8        *p;
+  uint8        *durations;
+  int64        prev = 0;
+  int64        i;
+  FILE         *f;
+
+  if (st->calendar_dirty)
+    calendar_rebuild(st);
+
+  /* at most 10 bytes per varint */
+  buf = (uint8 *) pg_malloc(Max(st->nrows, 1) * 20);
+
+  p = buf;
+  for (i = 0; i < st->nrows; i++)
+  {
+    p = encode_varint(p, ZIGZAG(st->deb[i] - prev));
+    prev = st->deb[i];
+  }
+  durations = p;
+  for (i = 0; i < st->nrows; i++)
+    p = encode_varint(p, ZIGZAG(st->fin[i] - st->deb[i]));
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CLIENTCOMPTAGE_LOCAL_MAGIC, 4);
+  hdr.version = CLIENTCOMPTAGE_LOCAL_VERSION;
+  hdr.nrows = st->nrows;
+  hdr.watermark = st->watermark;
+  hdr.lsn = st->lsn;
+  hdr.deb_bytes = durations - buf;
+  hdr.duration_bytes = p - durations;
+  hdr.first_year = st->first_year;
+  hdr.nyears = st->nyears;
+  strlcpy(hdr.timezone, st->timezone, sizeof(hdr.timezone));
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", opts->local_file);
+  f = fopen(tmpfile, "wb");
+  if (!f
+      || fwrite(&hdr, sizeof(hdr), 1, f) != 1
+      || fwrite(buf, 1, p - buf, f) != (size_t) (p - buf)
+      || (st->nyears > 0
+          && fwrite(st->calendar, sizeof(uint64) * CLIENTCOMPTAGE_CALENDAR_WORDS,
+                    st->nyears, f) != (size_t) st->nyears)
+      || fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0
+      || rename(tmpfile, opts->local_file) != 0)
+  {
+    pg_log_error("could not write file \"%s\": %m", opts->local_file);
+    exit(EXIT_FAILURE);
+  }
+
+  pg_free(buf);
+}
+
+
+/*
+ * Add a row to the local replica, keeping it sorted by deb
+ */
+void
+local_store_append(local_store *st, int64 deb, int64 fin)
+{
+  int64 pos;
+
+  if (st->nrows == st->capacity)
+  {
+    st->capacity = Max(st->capacity * 2, 1024);
+    st->deb = (int64 *) pg_realloc(st->deb, st->capacity * sizeof(int64));
+    st->fin = (int64 *) pg_realloc(st->fin, st->capacity * sizeof(int64));
+  }
+
+  /* rows mostly come in order, so look for the place from the end */
+  for (pos = st->nrows; pos > 0 && st->deb[pos - 1] > deb; pos--)
+    ;
+  if (pos < st->nrows)
+  {
+    memmove(st->deb + pos + 1, st->deb + pos, (st->nrows - pos) * sizeof(int64));
+    memmove(st->fin + pos + 1, st->fin + pos, (st->nrows - pos) * sizeof(int64));
+  }
+
+  st->deb[pos] = deb;
+  st->fin[pos] = fin;
+  st->nrows++;
+  st->watermark = Max(st->watermark, deb);
+  calendar_mark(st, deb, fin);
+}
+
+
+/*
+ * Find a row of the local replica, returns -1 if it is not there
+ */
+static int64
+local_store_find(const local_store *st, int64 deb, int64 fin)
+{
+  int64 lo = 0;
+  int64 hi = st->nrows;
+  int64 mid;
+
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (st->deb[mid] < deb)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < st->nrows && st->deb[lo] == deb; lo++)
+    if (st->fin[lo] == fin)
+      return lo;
+
+  return -1;
+}
+
+
+/*
+ * Remove a row of the local replica
+ */
+static void
+local_store_remove(local_store *st, int64 row)
+{
+  memmove(st->deb + row, st->deb + row + 1, (st->nrows - row - 1) * sizeof(int64));
+  memmove(st->fin + row, st->fin + row + 1, (st->nrows - row - 1) * sizeof(int64));
+  st->nrows--;
+
+  /* the day may still have other entries */
+  st->calendar_dirty = true;
+}
+
+
+/*
+ * Fetch rows of public.comptage into the local replica
+ *
+ * With a watermark, only the rows starting at it or later are fetched,
+ * and those already in the replica are skipped.
+ */
+static void
+sync_rows(local_store *st, int64 watermark)
+{
+  PGresult   *res;
+  const char *values[1];
+  char       mark[32];
+  int64      deb;
+  int64      fin;
+  int        ntuples;
+  int        i;
+
+  if (watermark == PG_INT64_MIN)
+    res = run_query("SELECT deb, fin FROM public.comptage "
+                    "WHERE deb IS NOT NULL AND fin IS NOT NULL ORDER BY deb",
+                    0, NULL, 1);
+  else
+  {
+    snprintf(mark, sizeof(mark), INT64_FORMAT, watermark);
+    values[0] = mark;
+    res = run_query("SELECT deb, fin FROM public.comptage "
+                    "WHERE deb >= 'epoch'::timestamptz + $1::int8 * interval '1 microsecond' "
+                    "AND fin IS NOT NULL ORDER BY deb",
+                    1, values, 1);
+  }
+
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  ntuples = PQntuples(res);
+  for (i = 0; i < ntuples; i++)
+  {
+    deb = (int64) pg_ntoh64(*(uint64 *) PQgetvalue(res, i, 0)) + POSTGRES_EPOCH_USECS;
+    fin = (int64) pg_ntoh64(*(uint64 *) PQgetvalue(res, i, 1)) + POSTGRES_EPOCH_USECS;
+    if (deb == watermark && local_store_find(st, deb, fin) >= 0)
+      continue;
+    local_store_append(st, deb, fin);
+  }
+  PQclear(res);
+}
+
+
+/*
+ * Whether the replica holds exactly the complete rows of the server
+ *
+ * Both sides compute the row count and the sums of deb, fin and
+ * deb * fin in microseconds since the Unix epoch, modulo 2^64.
+ */
+static bool
+sync_checksum_matches(const local_store *st)
+{
+  PGresult *res;
+  uint64   sums[3] = {0, 0, 0};
+  int64    i;
+  int      c;
+
+  for (i = 0; i < st->nrows; i++)
+  {
+    sums[0] += (uint64) st->deb[i];
+    sums[1] += (uint64) st->fin[i];
+    sums[2] += (uint64) st->deb[i] * (uint64) st->fin[i];
+  }
+
+  /* microseconds through integer fields, exact even before PostgreSQL 14 */
+  res = run_query("WITH r AS (SELECT "
+                  "extract(epoch FROM date_trunc('second', deb))::numeric * 1000000 "
+                  "+ extract(microseconds FROM deb)::int8 % 1000000 AS d, "
+                  "extract(epoch FROM date_trunc('second', fin))::numeric * 1000000 "
+                  "+ extract(microseconds FROM fin)::int8 % 1000000 AS f "
+                  "FROM public.comptage WHERE deb IS NOT NULL AND fin IS NOT NULL) "
+                  "SELECT count(*), "
+                  "(coalesce(sum(d), 0) % 18446744073709551616 + 18446744073709551616) % 18446744073709551616, "
+                  "(coalesce(sum(f), 0) % 18446744073709551616 + 18446744073709551616) % 18446744073709551616, "
+                  "(coalesce(sum(d * f), 0) % 18446744073709551616 + 18446744073709551616) % 18446744073709551616 "
+                  "FROM r",
+                  0, NULL, 0);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  if (strtoll(PQgetvalue(res, 0, 0), NULL, 10) != st->nrows)
+  {
+    PQclear(res);
+    return false;
+  }
+  for (c = 0; c < 3; c++)
+    if (strtoull(PQgetvalue(res, 0, c + 1), NULL, 10) != sums[c])
+    {
+      PQclear(res);
+      return false;
+    }
+  PQclear(res);
+  return true;
+}
+
+
+/*
+ * Current WAL position of the server, the replay position on a standby
+ */
+static int64
+current_wal_lsn(void)
+{
+  PGresult *res;
+  uint32   hi, lo;
+
+  res = run_query("SELECT CASE WHEN pg_is_in_recovery() "
+                  "THEN pg_last_wal_replay_lsn() ELSE pg_current_wal_lsn() END",
+                  0, NULL, 0);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK
+      || sscanf(PQgetvalue(res, 0, 0), "%X/%X", &hi, &lo) != 2)
+  {
+    pg_log_error("could not get the current WAL position: %s",
+                 PQerrorMessage(conn));
+    exit(EXIT_FAILURE);
+  }
+  PQclear(res);
+  return ((int64) hi << 32) | lo;
+}
+
+
+/*
+ * Bring the local replica up to date
+ *
+ * The rows starting at the watermark or later are fetched first, which
+ * is all there is to do when entries are only ever appended. Then a
+ * checksum of the whole table catches everything else: back-dated
+ * entries, fin set after a previous sync, updates and deletes. On a
+ * mismatch the replica is reloaded. --follow applies those changes as
+ * they happen, without reloading.
+ *
+ * The WAL position taken before the first query is recorded as the LSN
+ * of the replica: every transaction committed before it is in the file,
+ * and --follow skips them.
+ */
+void
+run_sync(void)
+{
+  local_store st;
+  int64       before;
+  int64       lsn;
+
+  local_store_load(&st);
+  before = st.nrows;
+  lsn = current_wal_lsn();
+
+  sync_rows(&st, st.watermark);
+  if (!sync_checksum_matches(&st))
+  {
+    if (opts->verbose)
+      pg_log_info("local replica differs from the server, reloading it");
+    st.nrows = 0;
+    st.watermark = PG_INT64_MIN;
+    st.calendar_dirty = true;
+    sync_rows(&st, PG_INT64_MIN);
+  }
+  st.lsn = Max(st.lsn, lsn);
+
+  if (PQparameterStatus(conn, "TimeZone"))
+    strlcpy(st.timezone, PQparameterStatus(conn, "TimeZone"),
+            sizeof(st.timezone));
+
+  local_store_save(&st);
+
+  if (opts->verbose)
+    pg_log_info("%lld rows before, %lld rows in \"%s\"",
+                (long long) before, (long long) st.nrows,
+                opts->local_file);
+
+  pg_free(st.deb);
+  pg_free(st.fin);
+  pg_free(st.calendar);
+}
+
+
+/*
+ * Current time in microseconds since 2000-01-01, as replication wants it
+ */
+static int64
+now_pg_usecs(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * USECS_PER_SEC + now.tv_nsec / 1000 - POSTGRES_EPOCH_USECS;
+}
+
+
+/*
+ * Tell the server how far the local replica is written
+ */
+static void
+send_feedback(PGconn *rconn, int64 lsn)
+{
+  char   buf[34];
+  uint64 v;
+
+  buf[0] = 'r';
+  v = pg_hton64(lsn);
+  memcpy(buf + 1, &v, 8);        /* written */
+  memcpy(buf + 9, &v, 8);        /* flushed */
+  memcpy(buf + 17, &v, 8);       /* applied */
+  v = pg_hton64(now_pg_usecs());
+  memcpy(buf + 25, &v, 8);
+  buf[33] = 0;
+
+  if (PQputCopyData(rconn, buf, sizeof(buf)) != 1 || PQflush(rconn) != 0)
+  {
+    pg_log_error("could not send feedback: %s", PQerrorMessage(rconn));
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+/*
+ * Read the deb and fin columns of a pgoutput TupleData
+ *
+ * Values are in text, and the replication session uses UTC with the ISO
+ * datestyle. deb and fin are set to PG_INT64_MIN when null. Returns the
+ * position right after the tuple.
+ */
+static const char *
+read_tuple(const char *p, int deb_col, int fin_col, int64 *deb, int64 *fin)
+{
+  int    ncols;
+  int    col;
+  uint32 len;
+  uint16 n16;
+
+  *deb = *fin = PG_INT64_MIN;
+
+  memcpy(&n16, p, 2);
+  ncols = pg_ntoh16(n16);
+  p += 2;
+
+  for (col = 0; col < ncols; col++)
+  {
+    if (*p++ != 't')
+      continue;
+    memcpy(&len, p, 4);
+    len = pg_ntoh32(len);
+    p += 4;
+    if (col == deb_col && !parse_timestamp(p, p + len, deb))
+      *deb = PG_INT64_MIN;
+    if (col == fin_col && !parse_timestamp(p, p + len, fin))
+      *fin = PG_INT64_MIN;
+    p += len;
+  }
+
+  return p;
+}
+
+
+/*
+ * Keep the local replica in sync through logical replication
+ *
+ * A publication on public.comptage and a pgoutput slot are created if
+ * they do not exist yet. Changes are applied in memory, and the file is
+ * rewritten at most once per status interval; only then is the server
+ * told the changes are flushed, so nothing is lost if the tool stops.
+ *
+ * Every session starts with a sync, which fills an empty replica and
+ * records the LSN it brought the file up to. Transactions already in the
+ * file, according to its LSN, are skipped.
+ */
+void
+run_follow(const ConnParams *cparams)
+{
+  const char *keywords[] = {"host", "port", "dbname", "user",
+                            "replication", "options", "application_name",
+                            NULL};
+  const char *values[] = {cparams->pghost, cparams->pgport,
+                          cparams->dbname, cparams->pguser,
+                          "database",
+                          "-c datestyle=ISO -c timezone=UTC",
+                          "clientcomptage", NULL};
+  local_store st;
+  PGconn      *rconn;
+  PGresult    *res;
+  char        *buf;
+  const char  *p;
+  const char  *name;
+  fd_set      fds;
+  struct timeval timeout;
+  time_t      last_save = time(NULL);
+  Oid         relid = InvalidOid;
+  Oid         id;
+  uint32      n32;
+  uint64      n64;
+  int64       final_lsn = 0;
+  int64       saved_lsn;
+  int64       sync_lsn;
+  int64       deb, fin;
+  int64       old_deb, old_fin;
+  int64       row;
+  int         deb_col = -1;
+  int         fin_col = -1;
+  int         ncols;
+  int         col;
+  int         len;
+  bool        dirty = false;
+  bool        skip = false;
+  bool        overlap;
+  bool        removed;
+  char        kind;
+
+  /* the publication, and full old rows for updates and deletes */
+  res = run_query("SELECT 1 FROM pg_publication WHERE pubname = '"
+                  CLIENTCOMPTAGE_SLOT_NAME "'", 0, NULL, 0);
+  if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 0)
+  {
+    execute("ALTER TABLE public.comptage REPLICA IDENTITY FULL");
+    execute("CREATE PUBLICATION " CLIENTCOMPTAGE_SLOT_NAME
+            " FOR TABLE public.comptage");
+  }
+  PQclear(res);
+
+  rconn = PQconnectdbParams(keywords, values, false);
+  if (PQstatus(rconn) != CONNECTION_OK)
+  {
+    pg_log_error("could not open replication connection: %s",
+                 PQerrorMessage(rconn));
+    exit(EXIT_FAILURE);
+  }
+
+  /* the slot may already exist, from a previous session */
+  res = PQexec(rconn, "CREATE_REPLICATION_SLOT " CLIENTCOMPTAGE_SLOT_NAME
+                      " LOGICAL pgoutput NOEXPORT_SNAPSHOT");
+  if (PQresultStatus(res) != PGRES_TUPLES_OK
+      && strcmp(PQresultErrorField(res, PG_DIAG_SQLSTATE) ?
+                PQresultErrorField(res, PG_DIAG_SQLSTATE) : "", "42710") != 0)
+  {
+    pg_log_error("could not create replication slot: %s",
+                 PQerrorMessage(rconn));
+    exit(EXIT_FAILURE);
+  }
+  PQclear(res);
+
+  /*
+   * Whether the slot is new or not, the replica may be missing rows, or
+   * hold rows the stream still has to send: --sync may have run since
+   * the last session, or the file may have been removed. Transactions
+   * committed before this position may be both in the sync and in the
+   * stream: their changes are checked against the replica, until the
+   * stream goes past it.
+   */
+  run_sync();
+  sync_lsn = current_wal_lsn();
+  overlap = true;
+
+  local_store_load(&st);
+
+  /* only what the replica file holds may be confirmed to the server */
+  saved_lsn = st.lsn;
+
+  res = PQexec(rconn, "START_REPLICATION SLOT " CLIENTCOMPTAGE_SLOT_NAME
+                      " LOGICAL 0/0 (proto_version '1', publication_names '"
+                      CLIENTCOMPTAGE_SLOT_NAME "')");
+  if (PQresultStatus(res) != PGRES_COPY_BOTH)
+  {
+    pg_log_error("could not start replication: %s", PQerrorMessage(rconn));
+    exit(EXIT_FAILURE);
+  }
+  PQclear(res);
+
+  atomic_init(&daemon_stop, false);
+  pqsignal(SIGINT, stop_daemon);
+  pqsignal(SIGTERM, stop_daemon);
+
+  while (!atomic_load(&daemon_stop))
+  {
+    /* save pending changes, then confirm them */
+    if (dirty && time(NULL) - last_save >= CLIENTCOMPTAGE_STATUS_INTERVAL)
+    {
+      local_store_save(&st);
+      saved_lsn = st.lsn;
+      send_feedback(rconn, saved_lsn);
+      dirty = false;
+      last_save = time(NULL);
+    }
+
+    len = PQgetCopyData(rconn, &buf, 1);
+    if (len == 0)
+    {
+      FD_ZERO(&fds);
+      FD_SET(PQsocket(rconn), &fds);
+      timeout.tv_sec = 1;
+      timeout.tv_usec = 0;
+      if (select(PQsocket(rconn) + 1, &fds, NULL, NULL, &timeout) > 0)
+        PQconsumeInput(rconn);
+      else if (!dirty && time(NULL) - last_save >= CLIENTCOMPTAGE_STATUS_INTERVAL)
+      {
+        send_feedback(rconn, saved_lsn);
+        last_save = time(NULL);
+      }
+      continue;
+    }
+    if (len < 0)
+      break;
+
+    /* keepalive: answer if asked to */
+    if (buf[0] == 'k')
+    {
+      if (buf[17])
+        send_feedback(rconn, saved_lsn);
+      PQfreemem(buf);
+      continue;
+    }
+    if (buf[0] != 'w')
+    {
+      PQfreemem(buf);
+      continue;
+    }
+
+    /* skip the XLogData header: start, end, send time */
+    p = buf + 25;
+    switch (*p++)
+    {
+      case 'B':
+        memcpy(&n64, p, 8);
+        final_lsn = pg_ntoh64(n64);
+        skip = final_lsn <= st.lsn;
+        if (overlap && final_lsn > sync_lsn)
+          overlap = false;
+        break;
+
+      case 'C':
+        if (!skip)
+        {
+          memcpy(&n64, p + 9, 8);
+          st.lsn = pg_ntoh64(n64);
+          dirty = true;
+        }
+        break;
+
+      case 'R':
+        /* find deb and fin among the columns of the relation */
+        memcpy(&n32, p, 4);
+        relid = pg_ntoh32(n32);
+        p += 4;
+        p += strlen(p) + 1;       /* namespace */
+        p += strlen(p) + 1;       /* relation */
+        p++;                      /* replica identity */
+        ncols = pg_ntoh16(*(uint16 *) p);
+        p += 2;
+        for (col = 0; col < ncols; col++)
+        {
+          name = p + 1;
+          if (strcmp(name, "deb") == 0)
+            deb_col = col;
+          else if (strcmp(name, "fin") == 0)
+            fin_col = col;
+          p = name + strlen(name) + 1 + 8;
+        }
+        break;
+
+      case 'I':
+      case 'U':
+      case 'D':
+        kind = p[-1];
+        memcpy(&n32, p, 4);
+        id = pg_ntoh32(n32);
+        p += 4;
+        if (skip || id != relid)
+          break;
+
+        old_deb = old_fin = deb = fin = PG_INT64_MIN;
+        if (*p == 'K' || *p == 'O')
+          p = read_tuple(p + 1, deb_col, fin_col, &old_deb, &old_fin);
+        if (*p == 'N')
+          read_tuple(p + 1, deb_col, fin_col, &deb, &fin);
+
+        removed = false;
+        if (kind != 'I' && old_deb != PG_INT64_MIN
+            && (row = local_store_find(&st, old_deb, old_fin)) >= 0)
+        {
+          local_store_remove(&st, row);
+          removed = true;
+        }
+        /* the sync may already hold the new row of an insert or update */
+        if (overlap && kind != 'D' && !removed
+            && local_store_find(&st, deb, fin) >= 0)
+          break;
+        if (kind != 'D' && deb != PG_INT64_MIN && fin != PG_INT64_MIN)
+          local_store_append(&st, deb, fin);
+        break;
+
+      case 'T':
+        if (!skip)
+        {
+          st.nrows = 0;
+          st.calendar_dirty = true;
+        }
+        break;
+    }
+
+    PQfreemem(buf);
+  }
+
+  if (dirty)
+  {
+    local_store_save(&st);
+    saved_lsn = st.lsn;
+    send_feedback(rconn, saved_lsn);
+  }
+
+  PQfinish(rconn);
+  pg_free(st.deb);
+  pg_free(st.fin);
+  pg_free(st.calendar);
+}
+
+
+/*
+ * Write a whole buffer to a file descriptor
+ */
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t written;
+
+  while (len > 0)
+  {
+    written = write(fd, buf, len);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      pg_log_error("could not write to \"%s\": %m", opts->export_file);
+      exit(EXIT_FAILURE);
+    }
+    buf += written;
+    len -= written;
+  }
+}
+
+
+/*
+ * Export writer: write the chunks to the file, compressing them first
+ * if asked, then give them back to the fetching thread
+ */
+static void *
+export_writer(void *arg)
+{
+  export_pipeline *ep = (export_pipeline *) arg;
+  export_chunk    *chunk;
+#ifdef USE_ZSTD
+  ZSTD_CCtx       *cctx = NULL;
+  ZSTD_inBuffer   in;
+  ZSTD_outBuffer  out;
+  size_t          remaining;
+
+  if (opts->compress)
+  {
+    cctx = ZSTD_createCCtx();
+    if (!cctx)
+    {
+      pg_log_error("could not create zstd compression context");
+      exit(EXIT_FAILURE);
+    }
+    out.size = ZSTD_CStreamOutSize();
+    out.dst = pg_malloc(out.size);
+  }
+#endif
+
+  while ((chunk = (export_chunk *) spsc_pop(&ep->full)) != NULL)
+  {
+#ifdef USE_ZSTD
+    if (cctx)
+    {
+      in.src = chunk->data;
+      in.size = chunk->len;
+      in.pos = 0;
+      while (in.pos < in.size)
+      {
+        out.pos = 0;
+        remaining = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_continue);
+        if (ZSTD_isError(remaining))
+        {
+          pg_log_error("could not compress export: %s",
+                       ZSTD_getErrorName(remaining));
+          exit(EXIT_FAILURE);
+        }
+        write_all(ep->fd, out.dst, out.pos);
+        ep->written += out.pos;
+      }
+    }
+    else
+#endif
+    {
+      write_all(ep->fd, chunk->data, chunk->len);
+      ep->written += chunk->len;
+    }
+
+    chunk->len = 0;
+    spsc_push(&ep->free, chunk);
+  }
+
+#ifdef USE_ZSTD
+  if (cctx)
+  {
+    /* flush the end of the zstd frame */
+    in.src = NULL;
+    in.size = in.pos = 0;
+    do
+    {
+      out.pos = 0;
+      remaining = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+      if (ZSTD_isError(remaining))
+      {
+        pg_log_error("could not compress export: %s",
+                     ZSTD_getErrorName(remaining));
+        exit(EXIT_FAILURE);
+      }
+      write_all(ep->fd, out.dst, out.pos);
+      ep->written += out.pos;
+    } while (remaining > 0);
+
+    pg_free(out.dst);
+    ZSTD_freeCCtx(cctx);
+  }
+#endif
+
+  return NULL;
+}
+
+
+/*
+ * Export public.comptage to a file with COPY TO STDOUT
+ *
+ * Rows are never parsed: the COPY data is appended as is to chunks of
+ * CLIENTCOMPTAGE_COPY_CHUNK_SIZE bytes, aligned on a page, and written
+ * with one write() each, so that the network and the disk both work at
+ * their own pace.
+ */
+void
+run_export(void)
+{
+  export_pipeline ep;
+  export_chunk    chunks[CLIENTCOMPTAGE_EXPORT_CHUNKS];
+  export_chunk    *chunk;
+  pthread_t       writer;
+  struct timespec start;
+  PGresult        *res;
+  char            *buf;
+  int64           received = 0;
+  double          elapsed;
+  size_t          n;
+  int             len;
+  int             i;
+
+  ep.fd = open(opts->export_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (ep.fd < 0)
+  {
+    pg_log_error("could not open \"%s\": %m", opts->export_file);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  ep.written = 0;
+
+  spsc_init(&ep.full, CLIENTCOMPTAGE_EXPORT_CHUNKS);
+  spsc_init(&ep.free, CLIENTCOMPTAGE_EXPORT_CHUNKS);
+  for (i = 0; i < CLIENTCOMPTAGE_EXPORT_CHUNKS; i++)
+  {
+    if (posix_memalign((void **) &chunks[i].data, CLIENTCOMPTAGE_EXPORT_ALIGN,
+                       CLIENTCOMPTAGE_COPY_CHUNK_SIZE) != 0)
+    {
+      pg_log_error("out of memory");
+      exit(EXIT_FAILURE);
+    }
+    chunks[i].len = 0;
+    spsc_push(&ep.free, &chunks[i]);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = PQexec(conn, opts->export_binary
+               ? "COPY (SELECT * FROM public.comptage ORDER BY deb) "
+                 "TO STDOUT (FORMAT binary)"
+               : "COPY (SELECT * FROM public.comptage ORDER BY deb) "
+                 "TO STDOUT (FORMAT csv, HEADER)");
+  if (PQresultStatus(res) != PGRES_COPY_OUT)
+  {
+    pg_log_error("could not start export: %s", PQerrorMessage(conn));
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  PQclear(res);
+
+  if (pthread_create(&writer, NULL, export_writer, &ep) != 0)
+  {
+    pg_log_error("could not create writer thread");
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  chunk = (export_chunk *) spsc_pop(&ep.free);
+  while ((len = PQgetCopyData(conn, &buf, 0)) > 0)
+  {
+    /* a message may straddle two chunks */
+    for (i = 0; i < len; i += n)
+    {
+      n = Min((size_t) (len - i), CLIENTCOMPTAGE_COPY_CHUNK_SIZE - chunk->len);
+      memcpy(chunk->data + chunk->len, buf + i, n);
+      chunk->len += n;
+      if (chunk->len == CLIENTCOMPTAGE_COPY_CHUNK_SIZE)
+      {
+        spsc_push(&ep.full, chunk);
+        chunk = (export_chunk *) spsc_pop(&ep.free);
+      }
+    }
+    received += len;
+    PQfreemem(buf);
+  }
+
+  if (chunk->len > 0)
+    spsc_push(&ep.full, chunk);
+  spsc_push(&ep.full, NULL);
+  pthread_join(writer, NULL);
+
+  if (len == -2)
+  {
+    pg_log_error("could not read export: %s", PQerrorMessage(conn));
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  res = PQgetResult(conn);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+  {
+    pg_log_error("export failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  if (fsync(ep.fd) != 0 || close(ep.fd) != 0)
+  {
+    pg_log_error("could not write to \"%s\": %m", opts->export_file);
+    exit(EXIT_FAILURE);
+  }
+
+  elapsed = elapsed_since(&start);
+  if (opts->verbose)
+    pg_log_info("%s rows, " INT64_FORMAT " bytes received, " INT64_FORMAT
+                " bytes written in %.2f s (%.1f MB/s)",
+                PQcmdTuples(res), received, ep.written, elapsed,
+                elapsed > 0 ? received / elapsed / (1024 * 1024) : 0.0);
+  PQclear(res);
+
+  for (i = 0; i < CLIENTCOMPTAGE_EXPORT_CHUNKS; i++)
+    free(chunks[i].data);
+  spsc_destroy(&ep.full);
+  spsc_destroy(&ep.free);
+}
+
+
+/*
+ * Format a number of days since the Unix epoch as a date
+ */
+static char *
+format_date(int64 days)
+{
+  int y, m, d;
+
+  civil_from_days(days, &y, &m, &d);
+  return arena_psprintf(&query_arena, "%04d-%02d-%02d", y, m, d);
+}
+
+
+/*
+ * Local day, since the Unix epoch, of a time in microseconds
+ */
+static inline int64
+local_day(int64 usecs)
+{
+  int64 secs = usecs / USECS_PER_SEC - (usecs % USECS_PER_SEC < 0);
+
+  secs += utc_offset(secs);
+  return secs / SECS_PER_DAY - (secs % SECS_PER_DAY < 0);
+}
+
+
+/*
+ * Aggregation kernel: total time per local day of a set of intervals
+ *
+ * deb and fin are columns of times in microseconds since the Unix epoch.
+ * Like the jours, semaines and mois views, and the --rolling query, the
+ * whole duration of an interval goes to the local day it starts on, even
+ * when it crosses midnight. A first pass computes the day of each
+ * interval and the bounds, the second one adds each interval to its day.
+ */
+void
+aggregate_days(const int64 *deb, const int64 *fin, int64 n, day_buckets *b)
+{
+  int64 *sday;
+  int64 first = PG_INT64_MAX;
+  int64 last = PG_INT64_MIN;
+  int64 i;
+
+  b->first = 0;
+  b->ndays = 0;
+  b->totals = NULL;
+  if (n == 0)
+    return;
+
+  sday = (int64 *) pg_malloc(n * sizeof(int64));
+  for (i = 0; i < n; i++)
+  {
+    sday[i] = local_day(deb[i]);
+    first = Min(first, sday[i]);
+    last = Max(last, sday[i]);
+  }
+
+  b->first = first;
+  b->ndays = last - first + 1;
+  b->totals = (int64 *) pg_malloc0(b->ndays * sizeof(int64));
+
+  for (i = 0; i < n; i++)
+    b->totals[sday[i] - first] += fin[i] - deb[i];
+
+  pg_free(sday);
+}
+
+
+/*
+ * Roll day totals up into days, ISO weeks or months
+ *
+ * keys and sums must hold ndays values. Keys are the first day of each
+ * period (monday for weeks). Returns the number of periods with time.
+ */
+int64
+rollup_days(const day_buckets *b, actions_t granularity,
+            int64 *keys, int64 *sums)
+{
+  int64 nkeys = 0;
+  int64 day;
+  int64 key;
+  int64 i;
+  int   y, m, d;
+
+  for (i = 0; i < b->ndays; i++)
+  {
+    if (b->totals[i] == 0)
+      continue;
+
+    day = b->first + i;
+    if (granularity == SEMAINES)
+      key = day - ((day + 3) % 7 + 7) % 7;
+    else if (granularity == MOIS)
+    {
+      civil_from_days(day, &y, &m, &d);
+      key = day - (d - 1);
+    }
+    else
+      key = day;
+
+    if (nkeys == 0 || keys[nkeys - 1] != key)
+    {
+      keys[nkeys] = key;
+      sums[nkeys++] = 0;
+    }
+    sums[nkeys - 1] += b->totals[i];
+  }
+
+  return nkeys;
+}
+
+
+/*
+ * Compute a report from the local replica, without any connection
+ *
+ * Weeks start on monday, and are labelled with it, months with their
+ * first day.
+ */
+void
+local_report(actions_t action)
+{
+  local_store       st;
+  day_buckets       days;
+  printQueryOpt     myopt;
+  printTableContent cont;
+  int64             i;
+  int64             nkeys;
+  int64             *keys;
+  int64             *sums;
+  char              *label;
+  char              *column;
+
+  local_store_load(&st);
+  if (st.timezone[0])
+  {
+    setenv("TZ", st.timezone, 1);
+    tzset();
+  }
+
+  if (action == CALENDAR)
+  {
+    calendar_report(&st);
+    pg_free(st.deb);
+    pg_free(st.fin);
+    pg_free(st.calendar);
+    return;
+  }
+
+  if (action == HEATMAP)
+  {
+    int64 cells[7][24];
+
+    memset(cells, 0, sizeof(cells));
+    for (i = 0; i < st.nrows; i++)
+      heatmap_add(st.deb[i], st.fin[i], cells);
+    print_heatmap(cells);
+    pg_free(st.deb);
+    pg_free(st.fin);
+    pg_free(st.calendar);
+    return;
+  }
+
+  if (action == STATS)
+  {
+    stats_from_store(&st, strcmp(opts->stats, "month") == 0);
+    pg_free(st.deb);
+    pg_free(st.fin);
+    pg_free(st.calendar);
+    return;
+  }
+
+  if (action == ROLLING)
+  {
+    aggregate_days(st.deb, st.fin, st.nrows, &days);
+    print_rolling(&days, NULL);
+    pg_free(days.totals);
+    pg_free(st.deb);
+    pg_free(st.fin);
+    pg_free(st.calendar);
+    return;
+  }
+
+  label = action == JOURS ? "Jours" : action == MOIS ? "Mois" : "Semaines";
+  column = action == JOURS ? "jour" : action == MOIS ? "mois" : "semaine";
+
+  atomic_store(&mem_phase, PHASE_QUERY);
+  aggregate_days(st.deb, st.fin, st.nrows, &days);
+  keys = (int64 *) pg_malloc(Max(days.ndays, 1) * sizeof(int64));
+  sums = (int64 *) pg_malloc(Max(days.ndays, 1) * sizeof(int64));
+  nkeys = rollup_days(&days, action, keys, sums);
+
+  atomic_store(&mem_phase, PHASE_PRINT);
+  init_print_options(&myopt, label);
+  printTableInit(&cont, &myopt.topt, myopt.title, 2,
+                 action == JOURS ? Min(nkeys, 10) : nkeys);
+  printTableAddHeader(&cont, column, false, 'l');
+  printTableAddHeader(&cont, "total", false, 'l');
+  for (i = 0; i < nkeys; i++)
+  {
+    /* same as the server: the ten latest days only */
+    int64 k = action == JOURS ? nkeys - 1 - i : i;
+
+    if (action == JOURS && i == 10)
+      break;
+    printTableAddCell(&cont, format_date(keys[k]), false, false);
+    printTableAddCell(&cont, format_interval(sums[k], 0, 0), false, false);
+  }
+  printTable(&cont, stdout, false, NULL);
+  printTableCleanup(&cont);
+  arena_reset(&query_arena);
+
+  pg_free(days.totals);
+  pg_free(keys);
+  pg_free(sums);
+  pg_free(st.deb);
+  pg_free(st.fin);
+  pg_free(st.calendar);
+}
+
+
+/*
+ * Sum of each day and the width - 1 days before it, in one pass
+ */
+void
+rolling_sums(const int64 *totals, int64 n, int width, int64 *sums)
+{
+  int64 sum = 0;
+  int64 i;
+
+  for (i = 0; i < n; i++)
+  {
+    sum += totals[i];
+    if (i >= width)
+      sum -= totals[i - width];
+    sums[i] = sum;
+  }
+}
+
+
+/*
+ * Print the 7-day and 4-week rolling totals of day buckets
+ *
+ * Only the days with some time are printed, and only the visible ones
+ * when visible is not NULL.
+ */
+static void
+print_rolling(const day_buckets *b, const bool *visible)
+{
+  printQueryOpt     myopt;
+  printTableContent cont;
+  int64             *week;
+  int64             *month;
+  int64             nrows = 0;
+  int64             i;
+
+  week = (int64 *) pg_malloc(Max(b->ndays, 1) * sizeof(int64));
+  month = (int64 *) pg_malloc(Max(b->ndays, 1) * sizeof(int64));
+  rolling_sums(b->totals, b->ndays, 7, week);
+  rolling_sums(b->totals, b->ndays, 28, month);
+
+  for (i = 0; i < b->ndays; i++)
+    if (b->totals[i] > 0 && (!visible || visible[i]))
+      nrows++;
+
+  atomic_store(&mem_phase, PHASE_PRINT);
+  init_print_options(&myopt, "Cumuls glissants");
+  printTableInit(&cont, &myopt.topt, myopt.title, 4, nrows);
+  printTableAddHeader(&cont, "jour", false, 'l');
+  printTableAddHeader(&cont, "total", false, 'l');
+  printTableAddHeader(&cont, "sept_jours", false, 'l');
+  printTableAddHeader(&cont, "quatre_semaines", false, 'l');
+  for (i = 0; i < b->ndays; i++)
+  {
+    if (b->totals[i] == 0 || (visible && !visible[i]))
+      continue;
+    printTableAddCell(&cont, format_date(b->first + i), false, false);
+    printTableAddCell(&cont, format_interval(b->totals[i], 0, 0), false, false);
+    printTableAddCell(&cont, format_interval(week[i], 0, 0), false, false);
+    printTableAddCell(&cont, format_interval(month[i], 0, 0), false, false);
+  }
+  printTable(&cont, stdout, false, NULL);
+  printTableCleanup(&cont);
+  arena_reset(&query_arena);
+
+  pg_free(week);
+  pg_free(month);
+}
+
+
+/*
+ * Report the 7-day and 4-week rolling totals of each day
+ *
+ * The server aggregates the days. Since PostgreSQL 11, it also computes
+ * the rolling sums with RANGE windows, and the report goes through
+ * fetch_table(). Older servers only send the days, and the sums are done
+ * here over dense day buckets. The range starts 27 days before --from or
+ * --last so that the first days get full windows.
+ */
+void
+rolling_report(void)
+{
+  PQExpBufferData sql;
+  PQExpBufferData visible;
+  PGresult        *res;
+  day_buckets     b;
+  bool            *shown;
+  const char      *values[4];
+  char            count[16];
+  int             nparams = 0;
+  int             ntuples;
+  int             i;
+
+  values[nparams++] = opts->tz ? opts->tz : PQparameterStatus(conn, "TimeZone");
+  if (!values[0])
+    values[0] = "UTC";
+
+  initPQExpBuffer(&sql);
+  initPQExpBuffer(&visible);
+  appendPQExpBufferStr(&sql, "WITH j AS (SELECT (deb AT TIME ZONE $1)::date AS jour, "
+                       "sum(fin - deb) AS total FROM public.comptage "
+                       "WHERE deb IS NOT NULL AND fin IS NOT NULL");
+  if (opts->from)
+  {
+    values[nparams++] = opts->from;
+    appendPQExpBuffer(&sql, " AND deb >= ($%d::date - 27)::timestamp AT TIME ZONE $1",
+                      nparams);
+    appendPQExpBuffer(&visible, "jour >= $%d::date", nparams);
+  }
+  else if (opts->last)
+  {
+    snprintf(count, sizeof(count), "%d", opts->last - 1);
+    values[nparams++] = count;
+    appendPQExpBuffer(&sql, " AND deb >= ((now() AT TIME ZONE $1)::date - $%d::int - 27)"
+                      "::timestamp AT TIME ZONE $1", nparams);
+    appendPQExpBuffer(&visible, "jour >= (now() AT TIME ZONE $1)::date - $%d::int",
+                      nparams);
+  }
+  else
+    appendPQExpBufferStr(&visible, "true");
+  if (opts->to)
+  {
+    values[nparams++] = opts->to;
+    appendPQExpBuffer(&sql, " AND deb < $%d::timestamp AT TIME ZONE $1", nparams);
+  }
+  appendPQExpBufferStr(&sql, " GROUP BY 1) ");
+
+  if (caps.range_offset)
+  {
+    /* the windows need the hidden days, they are filtered afterwards */
+    appendPQExpBuffer(&sql, "SELECT * FROM (SELECT jour, total, "
+                      "sum(total) OVER (ORDER BY jour RANGE BETWEEN "
+                      "interval '6 days' PRECEDING AND CURRENT ROW) AS sept_jours, "
+                      "sum(total) OVER (ORDER BY jour RANGE BETWEEN "
+                      "interval '27 days' PRECEDING AND CURRENT ROW) AS quatre_semaines "
+                      "FROM j) r WHERE %s ORDER BY jour", visible.data);
+    fetch_table("Cumuls glissants", sql.data, nparams, values);
+    termPQExpBuffer(&sql);
+    termPQExpBuffer(&visible);
+    return;
+  }
+
+  appendPQExpBuffer(&sql, "SELECT jour, total, %s FROM j ORDER BY jour",
+                    visible.data);
+  res = run_query(sql.data, nparams, values, 1);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql.data);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* dense buckets, from the first day to the last one */
+  ntuples = PQntuples(res);
+  b.first = 0;
+  b.ndays = 0;
+  if (ntuples > 0)
+  {
+    b.first = (int32) pg_ntoh32(*(uint32 *) PQgetvalue(res, 0, 0))
+              + POSTGRES_EPOCH_DAYS;
+    b.ndays = (int32) pg_ntoh32(*(uint32 *) PQgetvalue(res, ntuples - 1, 0))
+              + POSTGRES_EPOCH_DAYS - b.first + 1;
+  }
+  b.totals = (int64 *) pg_malloc0(Max(b.ndays, 1) * sizeof(int64));
+  shown = (bool *) pg_malloc0(Max(b.ndays, 1) * sizeof(bool));
+  for (i = 0; i < ntuples; i++)
+  {
+    const char *v = PQgetvalue(res, i, 1);
+    int64      d = (int32) pg_ntoh32(*(uint32 *) PQgetvalue(res, i, 0))
+                   + POSTGRES_EPOCH_DAYS - b.first;
+
+    /* interval: microseconds, days, months */
+    b.totals[d] = (int64) pg_ntoh64(*(uint64 *) v)
+                  + (int32) pg_ntoh32(*(uint32 *) (v + 8)) * USECS_PER_DAY
+                  + (int32) pg_ntoh32(*(uint32 *) (v + 12)) * 30 * USECS_PER_DAY;
+    shown[d] = *PQgetvalue(res, i, 2) != 0;
+  }
+  PQclear(res);
+
+  print_rolling(&b, shown);
+
+  pg_free(b.totals);
+  pg_free(shown);
+  termPQExpBuffer(&sql);
+  termPQExpBuffer(&visible);
+}
+
+
+/*
+ * Format a timestamp, in microseconds since the Unix epoch
+ */
+static char *
+format_timestamp(int64 usecs)
+{
+  PQExpBuffer buf = scratch_buffer();
+
+  append_timestamp(buf, usecs, true);
+  return arena_strdup(&query_arena, buf->data);
+}
+
+
+/*
+ * Find, and optionally merge, overlapping entries
+ *
+ * Entries are streamed ordered by deb, and a sweep line keeps the union
+ * of the current group of overlapping entries: an entry starting before
+ * the end of the group joins it. Entries that only touch do not overlap.
+ * Only the groups of more than one entry are kept for the report.
+ *
+ * With --fix, the table is locked for the whole transaction so that the
+ * ctids read stay valid. The other entries of each group are deleted,
+ * then the first one gets the bounds of the group, in two statements.
+ */
+void
+merge_overlaps(void)
+{
+  PQExpBufferData keep_ids;
+  PQExpBufferData keep_deb;
+  PQExpBufferData keep_fin;
+  PQExpBufferData del_ids;
+  printQueryOpt   myopt;
+  printTableContent cont;
+  PGresult        *res;
+  const char      *values[4];
+  char            keeper[32] = "";
+  char            ctid[32] = "";
+  int64           gdeb = 0;
+  int64           gfin = PG_INT64_MIN;
+  int64           gsum = 0;
+  int64           gcount = 0;
+  int64           scanned = 0;
+  int64           doubled = 0;
+  int64           ngroups = 0;
+  int64           capacity = 0;
+  int64           *groups = NULL;
+  int64           i;
+  int             t;
+
+  /* deb, fin, entries and double-counted time of each group */
+#define OVERLAP_FIELDS 4
+
+  initPQExpBuffer(&keep_ids);
+  initPQExpBuffer(&keep_deb);
+  initPQExpBuffer(&keep_fin);
+  initPQExpBuffer(&del_ids);
+
+  if (opts->fix)
+  {
+    /* nothing in this transaction may be replayed: ctids are per session */
+    execute_once("BEGIN");
+    execute_once("LOCK TABLE public.comptage IN SHARE ROW EXCLUSIVE MODE");
+  }
+
+  if (!PQsendQueryParams(conn, "SELECT ctid, deb, fin FROM public.comptage "
+                         "WHERE deb IS NOT NULL AND fin IS NOT NULL "
+                         "ORDER BY deb, fin",
+                         0, NULL, NULL, NULL, NULL, 1)
+#ifdef LIBPQ_HAS_CHUNK_MODE
+      || (caps.chunked_rows
+          ? !PQsetChunkedRowsMode(conn, CLIENTCOMPTAGE_CHUNK_ROWS)
+          : !PQsetSingleRowMode(conn)))
+#else
+      || !PQsetSingleRowMode(conn))
+#endif
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* a sentinel row past every entry closes the last group */
+  for (;;)
+  {
+    res = PQgetResult(conn);
+    if (res && !is_row_result(res))
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+
+    for (t = 0; t < (res ? PQntuples(res) : 1); t++)
+    {
+      int64 deb = PG_INT64_MAX;
+      int64 fin = PG_INT64_MAX;
+
+      if (res)
+      {
+        const char *v = PQgetvalue(res, t, 0);
+
+        /* tid: block number and offset */
+        snprintf(ctid, sizeof(ctid), "(%u,%u)",
+                 pg_ntoh32(*(uint32 *) v), pg_ntoh16(*(uint16 *) (v + 4)));
+        deb = (int64) pg_ntoh64(*(uint64 *) PQgetvalue(res, t, 1));
+        fin = (int64) pg_ntoh64(*(uint64 *) PQgetvalue(res, t, 2));
+        scanned++;
+      }
+
+      if (deb < gfin)
+      {
+        /* overlap: the entry joins the group */
+        gfin = Max(gfin, fin);
+        gsum += fin - deb;
+        gcount++;
+        appendPQExpBuffer(&del_ids, "%s\"%s\"", del_ids.len ? "," : "", ctid);
+        continue;
+      }
+
+      if (gcount > 1)
+      {
+        if (ngroups == capacity)
+        {
+          capacity = Max(capacity * 2, 64);
+          groups = (int64 *) pg_realloc(groups, capacity * OVERLAP_FIELDS
+                                        * sizeof(int64));
+        }
+        groups[ngroups * OVERLAP_FIELDS] = gdeb;
+        groups[ngroups * OVERLAP_FIELDS + 1] = gfin;
+        groups[ngroups * OVERLAP_FIELDS + 2] = gcount;
+        groups[ngroups * OVERLAP_FIELDS + 3] = gsum - (gfin - gdeb);
+        doubled += gsum - (gfin - gdeb);
+        ngroups++;
+
+        appendPQExpBuffer(&keep_ids, "%s\"%s\"", keep_ids.len ? "," : "", keeper);
+        appendPQExpBuffer(&keep_deb, "%s" INT64_FORMAT, keep_deb.len ? "," : "", gdeb);
+        appendPQExpBuffer(&keep_fin, "%s" INT64_FORMAT, keep_fin.len ? "," : "", gfin);
+      }
+
+      /* a new group starts */
+      gdeb = deb;
+      gfin = fin;
+      gsum = fin - deb;
+      gcount = 1;
+      strlcpy(keeper, ctid, sizeof(keeper));
+    }
+
+    if (!res)
+      break;
+    PQclear(res);
+  }
+
+  if (opts->verbose)
+    pg_log_info(INT64_FORMAT " entries scanned, " INT64_FORMAT
+                " groups of overlapping entries", scanned, ngroups);
+
+  atomic_store(&mem_phase, PHASE_PRINT);
+  init_print_options(&myopt, "Chevauchements");
+  printTableInit(&cont, &myopt.topt, myopt.title, 4, ngroups);
+  printTableAddHeader(&cont, "deb", false, 'l');
+  printTableAddHeader(&cont, "fin", false, 'l');
+  printTableAddHeader(&cont, "pointages", false, 'r');
+  printTableAddHeader(&cont, "compte_en_double", false, 'l');
+  for (i = 0; i < ngroups; i++)
+  {
+    int64 *g = groups + i * OVERLAP_FIELDS;
+
+    printTableAddCell(&cont, format_timestamp(g[0] + POSTGRES_EPOCH_USECS),
+                      false, false);
+    printTableAddCell(&cont, format_timestamp(g[1] + POSTGRES_EPOCH_USECS),
+                      false, false);
+    printTableAddCell(&cont, arena_psprintf(&query_arena, INT64_FORMAT, g[2]),
+                      false, false);
+    printTableAddCell(&cont, format_interval(g[3], 0, 0), false, false);
+  }
+  printTableAddFooter(&cont, arena_psprintf(&query_arena,
+                                            "total compté en double : %s",
+                                            format_interval(doubled, 0, 0)));
+  printTable(&cont, stdout, false, NULL);
+  printTableCleanup(&cont);
+  arena_reset(&query_arena);
+
+  if (opts->fix)
+  {
+    if (ngroups > 0)
+    {
+      PQExpBufferData arrays[4];
+
+      for (i = 0; i < 4; i++)
+        initPQExpBuffer(&arrays[i]);
+      appendPQExpBuffer(&arrays[0], "{%s}", keep_ids.data);
+      appendPQExpBuffer(&arrays[1], "{%s}", keep_deb.data);
+      appendPQExpBuffer(&arrays[2], "{%s}", keep_fin.data);
+      appendPQExpBuffer(&arrays[3], "{%s}", del_ids.data);
+      for (i = 0; i < 4; i++)
+        values[i] = arrays[i].data;
+
+      /* delete first, the exclusion constraint would refuse the updates */
+      res = run_query_once("DELETE FROM public.comptage WHERE ctid = ANY($1::tid[])",
+                           1, values + 3, 0);
+      if (PQresultStatus(res) == PGRES_COMMAND_OK)
+      {
+        if (opts->verbose)
+          pg_log_info("%s entries deleted", PQcmdTuples(res));
+        PQclear(res);
+        res = run_query_once("UPDATE public.comptage c "
+                             "SET deb = timestamptz '2000-01-01 00:00:00+00' + u.deb * interval '1 microsecond', "
+                             "fin = timestamptz '2000-01-01 00:00:00+00' + u.fin * interval '1 microsecond' "
+                             "FROM unnest($1::tid[], $2::int8[], $3::int8[]) AS u(id, deb, fin) "
+                             "WHERE c.ctid = u.id",
+                             3, values, 0);
+      }
+      if (PQresultStatus(res) != PGRES_COMMAND_OK)
+      {
+        pg_log_error("could not merge overlapping entries: %s",
+                     PQerrorMessage(conn));
+        PQclear(res);
+        PQfinish(conn);
+        exit(EXIT_FAILURE);
+      }
+      PQclear(res);
+
+      for (i = 0; i < 4; i++)
+        termPQExpBuffer(&arrays[i]);
+    }
+    execute_once("COMMIT");
+  }
+
+#undef OVERLAP_FIELDS
+
+  pg_free(groups);
+  termPQExpBuffer(&keep_ids);
+  termPQExpBuffer(&keep_deb);
+  termPQExpBuffer(&keep_fin);
+  termPQExpBuffer(&del_ids);
+}
+
+
+/*
+ * Install what clientcomptage relies on in public.comptage
+ *
+ * Everything is idempotent. With --exclude-overlaps, an exclusion
+ * constraint makes the server refuse overlapping entries with a GiST
+ * index probe at insert time. The range is a stored generated column
+ * when the server supports them, an expression otherwise. Entries
+ * without fin are not checked.
+ */
+void
+install_schema(void)
+{
+  PGresult *res;
+
+  /* a replay after a reconnection would run outside the transaction */
+  execute_once("BEGIN");
+  execute_once("ALTER TABLE public.comptage ADD COLUMN IF NOT EXISTS cle text UNIQUE");
+  execute_once("CREATE INDEX IF NOT EXISTS comptage_deb_idx ON public.comptage (deb)");
+
+  if (opts->exclude_overlaps)
+  {
+    res = run_query_once("SELECT 1 FROM pg_constraint "
+                    "WHERE conrelid = 'public.comptage'::regclass "
+                         "AND conname = 'comptage_sans_chevauchement'",
+                         0, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      PQclear(res);
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+
+    if (PQntuples(res) == 0)
+    {
+      PGresult *added;
+
+      if (caps.generated_columns)
+      {
+        execute_once("ALTER TABLE public.comptage ADD COLUMN IF NOT EXISTS periode "
+                     "tstzrange GENERATED ALWAYS AS (tstzrange(deb, fin)) STORED");
+        added = run_query_once("ALTER TABLE public.comptage "
+                               "ADD CONSTRAINT comptage_sans_chevauchement "
+                               "EXCLUDE USING gist (periode WITH &&) "
+                               "WHERE (fin IS NOT NULL)",
+                               0, NULL, 0);
+      }
+      else
+        added = run_query_once("ALTER TABLE public.comptage "
+                               "ADD CONSTRAINT comptage_sans_chevauchement "
+                               "EXCLUDE USING gist (tstzrange(deb, fin) WITH &&) "
+                               "WHERE (fin IS NOT NULL)",
+                               0, NULL, 0);
+
+      if (PQresultStatus(added) != PGRES_COMMAND_OK)
+      {
+        pg_log_error("could not add the exclusion constraint: %s",
+                     PQerrorMessage(conn));
+        if (strcmp(PQresultErrorField(added, PG_DIAG_SQLSTATE) ?
+                   PQresultErrorField(added, PG_DIAG_SQLSTATE) : "", "23P01") == 0)
+          pg_log_info("merge the existing overlaps first with --merge-overlaps --fix");
+        PQclear(added);
+        PQfinish(conn);
+        exit(EXIT_FAILURE);
+      }
+      PQclear(added);
+    }
+    PQclear(res);
+  }
+
+  execute_once("COMMIT");
+}
+
+
+/*
+ * Add an entry, explaining overlaps refused by the exclusion constraint
+ */
+void
+add_entry(char *sql)
+{
+  PGresult   *res;
+  const char *sqlstate;
+
+  if (opts->script)
+  {
+    execute(sql);
+    return;
+  }
+
+  res = run_query(sql, 0, NULL, 0);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+  {
+    sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    if (sqlstate && strcmp(sqlstate, "23P01") == 0)
+    {
+      pg_log_error("this entry overlaps an existing one");
+      if (PQresultErrorField(res, PG_DIAG_MESSAGE_DETAIL))
+        pg_log_info("%s", PQresultErrorField(res, PG_DIAG_MESSAGE_DETAIL));
+    }
+    else
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      pg_log_info("query was: %s", sql);
+    }
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  PQclear(res);
+}
+
+
+/*
+ * Mark a day, in days since the Unix epoch, in the calendar
+ */
+static void
+calendar_set(local_store *st, int64 day)
+{
+  const size_t year_size = CLIENTCOMPTAGE_CALENDAR_WORDS * sizeof(uint64);
+  uint64       *calendar;
+  int64        doy;
+  int          y, m, d;
+  int          shift;
+
+  civil_from_days(day, &y, &m, &d);
+  doy = day - days_from_civil(y, 1, 1);
+
+  if (st->nyears == 0)
+  {
+    st->first_year = y;
+    st->nyears = 1;
+    st->calendar = (uint64 *) pg_malloc0(year_size);
+  }
+  else if (y < st->first_year)
+  {
+    shift = st->first_year - y;
+    calendar = (uint64 *) pg_malloc0((st->nyears + shift) * year_size);
+    memcpy(calendar + shift * CLIENTCOMPTAGE_CALENDAR_WORDS, st->calendar,
+           st->nyears * year_size);
+    pg_free(st->calendar);
+    st->calendar = calendar;
+    st->first_year = y;
+    st->nyears += shift;
+  }
+  else if (y >= st->first_year + st->nyears)
+  {
+    shift = y - st->first_year + 1 - st->nyears;
+    st->calendar = (uint64 *) pg_realloc(st->calendar,
+                                         (st->nyears + shift) * year_size);
+    memset(st->calendar + st->nyears * CLIENTCOMPTAGE_CALENDAR_WORDS, 0,
+           shift * year_size);
+    st->nyears += shift;
+  }
+
+  st->calendar[(y - st->first_year) * CLIENTCOMPTAGE_CALENDAR_WORDS + doy / 64]
+    |= UINT64CONST(1) << (doy % 64);
+}
+
+
+/*
+ * Mark the local days an entry covers, fin being excluded
+ */
+static void
+calendar_mark(local_store *st, int64 deb, int64 fin)
+{
+  int64 last = local_day(Max(fin, deb + 1) - 1);
+  int64 d;
+
+  for (d = local_day(deb); d <= last; d++)
+    calendar_set(st, d);
+}
+
+
+/*
+ * Compute the calendar again from the rows
+ */
+static void
+calendar_rebuild(local_store *st)
+{
+  int64 i;
+
+  if (st->calendar)
+    memset(st->calendar, 0,
+           st->nyears * CLIENTCOMPTAGE_CALENDAR_WORDS * sizeof(uint64));
+  for (i = 0; i < st->nrows; i++)
+    calendar_mark(st, st->deb[i], st->fin[i]);
+  st->calendar_dirty = false;
+}
+
+
+/*
+ * Whether a day holds an entry
+ */
+static bool
+calendar_test(const local_store *st, int64 day)
+{
+  int   y, m, d;
+  int64 doy;
+
+  civil_from_days(day, &y, &m, &d);
+  if (y < st->first_year || y >= st->first_year + st->nyears)
+    return false;
+  doy = day - days_from_civil(y, 1, 1);
+  return (st->calendar[(y - st->first_year) * CLIENTCOMPTAGE_CALENDAR_WORDS
+                       + doy / 64] >> (doy % 64)) & 1;
+}
+
+
+/*
+ * Number of days holding an entry, from day from to day to excluded
+ *
+ * Whole words are counted with popcount, only the ends are masked.
+ */
+static int
+calendar_count(const local_store *st, int64 from, int64 to)
+{
+  const uint64 *words;
+  int64        start;
+  int64        end;
+  int64        w;
+  int          count = 0;
+  int          y, m, d;
+
+  while (from < to)
+  {
+    civil_from_days(from, &y, &m, &d);
+    start = from - days_from_civil(y, 1, 1);
+    end = Min(to, days_from_civil(y + 1, 1, 1)) - days_from_civil(y, 1, 1);
+    from = days_from_civil(y, 1, 1) + end;
+    if (y < st->first_year || y >= st->first_year + st->nyears)
+      continue;
+
+    words = st->calendar + (y - st->first_year) * CLIENTCOMPTAGE_CALENDAR_WORDS;
+    for (w = start / 64; w * 64 < end; w++)
+    {
+      uint64 word = words[w];
+
+      if (w == start / 64)
+        word &= ~UINT64CONST(0) << (start % 64);
+      if ((w + 1) * 64 > end)
+        word &= ~(~UINT64CONST(0) << (end % 64));
+      count += __builtin_popcountll(word);
+    }
+  }
+  return count;
+}
+
+
+/*
+ * Parse a YYYY-MM-DD date into days since the Unix epoch
+ */
+static bool
+parse_date(const char *s, int64 *day)
+{
+  int y, m, d;
+
+  if (sscanf(s, "%d-%d-%d", &y, &m, &d) != 3
+      || m < 1 || m > 12 || d < 1 || d > 31)
+    return false;
+  *day = days_from_civil(y, m, d);
+  return true;
+}
+
+
+/*
+ * Reports on the days holding entries, from the calendar of the local
+ * replica
+ *
+ * days: worked days per month. gaps: week days without entry between
+ * --from and --to, this month up to today by default. streaks: runs of
+ * at least two consecutive worked days.
+ */
+void
+calendar_report(local_store *st)
+{
+  printQueryOpt     myopt;
+  printTableContent cont;
+  struct timespec   now;
+  int64             first;
+  int64             last;
+  int64             from;
+  int64             to;
+  int64             day;
+  int64             start;
+  int64             nrows = 0;
+  int               pass;
+  int               y, m, d;
+
+  static const char *const weekdays[] = {
+    "jeudi", "vendredi", "samedi", "dimanche", "lundi", "mardi", "mercredi"
+  };
+
+  if (st->calendar_dirty)
+    calendar_rebuild(st);
+
+  /* bounds of the calendar */
+  first = st->nyears > 0 ? days_from_civil(st->first_year, 1, 1) : 0;
+  last = st->nyears > 0 ? days_from_civil(st->first_year + st->nyears, 1, 1) : 0;
+  while (last > first && !calendar_test(st, last - 1))
+    last--;
+  while (first < last && !calendar_test(st, first))
+    first++;
+
+  init_print_options(&myopt, strcmp(opts->calendar, "days") == 0
+                     ? "Jours travaillés"
+                     : strcmp(opts->calendar, "gaps") == 0
+                     ? "Jours sans pointage" : "Séries");
+
+  if (strcmp(opts->calendar, "days") == 0)
+  {
+    /* first pass counts the rows, second one prints them */
+    for (pass = 0; pass < 2; pass++)
+    {
+      if (pass == 1)
+      {
+        printTableInit(&cont, &myopt.topt, myopt.title, 2, nrows);
+        printTableAddHeader(&cont, "mois", false, 'l');
+        printTableAddHeader(&cont, "jours", false, 'r');
+      }
+      for (day = first; day < last;)
+      {
+        civil_from_days(day, &y, &m, &d);
+        start = days_from_civil(y, m, 1);
+        day = m == 12 ? days_from_civil(y + 1, 1, 1) : days_from_civil(y, m + 1, 1);
+        if (pass == 0)
+          nrows++;
+        else
+        {
+          printTableAddCell(&cont, format_date(start), false, false);
+          printTableAddCell(&cont, arena_psprintf(&query_arena, "%d",
+                                                  calendar_count(st, start, day)),
+                            false, false);
+        }
+      }
+    }
+  }
+  else if (strcmp(opts->calendar, "gaps") == 0)
+  {
+    clock_gettime(CLOCK_REALTIME, &now);
+    to = local_day(now.tv_sec * USECS_PER_SEC) + 1;
+    civil_from_days(to - 1, &y, &m, &d);
+    from = days_from_civil(y, m, 1);
+    if ((opts->from && !parse_date(opts->from, &from))
+        || (opts->to && !parse_date(opts->to, &to)))
+    {
+      pg_log_error("dates must be written YYYY-MM-DD");
+      exit(EXIT_FAILURE);
+    }
+
+    for (pass = 0; pass < 2; pass++)
+    {
+      if (pass == 1)
+      {
+        printTableInit(&cont, &myopt.topt, myopt.title, 2, nrows);
+        printTableAddHeader(&cont, "jour", false, 'l');
+        printTableAddHeader(&cont, "semaine", false, 'l');
+      }
+      for (day = from; day < to; day++)
+      {
+        /* 1970-01-01 was a thursday, skip saturdays and sundays */
+        int weekday = ((day % 7) + 7) % 7;
+
+        if (weekday == 2 || weekday == 3 || calendar_test(st, day))
+          continue;
+        if (pass == 0)
+          nrows++;
+        else
+        {
+          printTableAddCell(&cont, format_date(day), false, false);
+          printTableAddCell(&cont, (char *) weekdays[weekday], false, false);
+        }
+      }
+    }
+  }
+  else
+  {
+    for (pass = 0; pass < 2; pass++)
+    {
+      if (pass == 1)
+      {
+        printTableInit(&cont, &myopt.topt, myopt.title, 3, nrows);
+        printTableAddHeader(&cont, "debut", false, 'l');
+        printTableAddHeader(&cont, "fin", false, 'l');
+        printTableAddHeader(&cont, "jours", false, 'r');
+      }
+      for (day = first; day < last;)
+      {
+        if (!calendar_test(st, day))
+        {
+          day++;
+          continue;
+        }
+        for (start = day; day < last && calendar_test(st, day); day++)
+          ;
+        if (day - start < 2)
+          continue;
+        if (pass == 0)
+          nrows++;
+        else
+        {
+          printTableAddCell(&cont, format_date(start), false, false);
+          printTableAddCell(&cont, format_date(day - 1), false, false);
+          printTableAddCell(&cont, arena_psprintf(&query_arena, INT64_FORMAT,
+                                                  day - start),
+                            false, false);
+        }
+      }
+    }
+  }
+
+  printTable(&cont, stdout, false, NULL);
+  printTableCleanup(&cont);
+  arena_reset(&query_arena);
+}
+
+
+/*
+ * Empty t-digest
+ */
+void
+tdigest_init(tdigest *td)
+{
+  td->count = 0;
+  td->min = 0;
+  td->max = 0;
+  td->sum = 0;
+  td->nmerged = 0;
+  td->ncentroids = 0;
+}
+
+
+/*
+ * Buffer a centroid, compressing the digest when it is full
+ */
+static void
+tdigest_add_centroid(tdigest *td, double mean, double weight)
+{
+  if (td->ncentroids == CLIENTCOMPTAGE_TDIGEST_CAPACITY)
+    tdigest_compress(td);
+  td->centroids[td->ncentroids].mean = mean;
+  td->centroids[td->ncentroids].weight = weight;
+  td->ncentroids++;
+}
+
+
+/*
+ * Add a value to a t-digest
+ */
+void
+tdigest_add(tdigest *td, double value)
+{
+  if (td->count == 0 || value < td->min)
+    td->min = value;
+  if (td->count == 0 || value > td->max)
+    td->max = value;
+  td->count++;
+  td->sum += value;
+  tdigest_add_centroid(td, value, 1);
+}
+
+
+/*
+ * Merge the values of a t-digest into another one
+ */
+void
+tdigest_merge(tdigest *dst, const tdigest *src)
+{
+  int i;
+
+  if (src->count == 0)
+    return;
+  if (dst->count == 0 || src->min < dst->min)
+    dst->min = src->min;
+  if (dst->count == 0 || src->max > dst->max)
+    dst->max = src->max;
+  dst->count += src->count;
+  dst->sum += src->sum;
+  for (i = 0; i < src->ncentroids; i++)
+    tdigest_add_centroid(dst, src->centroids[i].mean, src->centroids[i].weight);
+}
+
+
+/*
+ * Order centroids by mean
+ */
+static int
+centroid_cmp(const void *a, const void *b)
+{
+  double ma = ((const centroid *) a)->mean;
+  double mb = ((const centroid *) b)->mean;
+
+  return (ma > mb) - (ma < mb);
+}
+
+
+/*
+ * Sort the centroids and merge the neighbours that fit together
+ *
+ * With the k1 scale function, k(q) = δ / 2π · asin(2q - 1), a centroid
+ * spans at most one unit of k: centroids are small near the tails, which
+ * keeps p99 accurate, and there are about δ of them at most.
+ */
+static void
+tdigest_compress(tdigest *td)
+{
+  const double delta = CLIENTCOMPTAGE_TDIGEST_COMPRESSION;
+  double       total = 0;
+  double       so_far = 0;
+  double       limit;
+  int          n = 0;
+  int          i;
+
+  if (td->ncentroids == td->nmerged)
+    return;
+
+  qsort(td->centroids, td->ncentroids, sizeof(centroid), centroid_cmp);
+  for (i = 0; i < td->ncentroids; i++)
+    total += td->centroids[i].weight;
+
+  /* quantile where the current centroid must stop */
+  limit = (sin(Min(asin(-1.0) + 2 * M_PI / delta, M_PI / 2)) + 1) / 2;
+  for (i = 1; i < td->ncentroids; i++)
+  {
+    centroid *cur = &td->centroids[n];
+    centroid *next = &td->centroids[i];
+
+    if ((so_far + cur->weight + next->weight) / total <= limit)
+    {
+      cur->weight += next->weight;
+      cur->mean += (next->mean - cur->mean) * next->weight / cur->weight;
+      continue;
+    }
+
+    so_far += cur->weight;
+    limit = (sin(Min(asin(2 * so_far / total - 1) + 2 * M_PI / delta,
+                     M_PI / 2)) + 1) / 2;
+    td->centroids[++n] = *next;
+  }
+
+  td->ncentroids = n + 1;
+  td->nmerged = td->ncentroids;
+}
+
+
+/*
+ * Estimate a quantile, interpolating between the centers of centroids
+ */
+double
+tdigest_quantile(tdigest *td, double q)
+{
+  double target;
+  double cum = 0;
+  double prev_center;
+  double prev_mean;
+  int    i;
+
+  if (td->count == 0)
+    return 0;
+  tdigest_compress(td);
+
+  target = q * td->count;
+  prev_center = 0;
+  prev_mean = td->min;
+  for (i = 0; i < td->ncentroids; i++)
+  {
+    const centroid *c = &td->centroids[i];
+    double         center = cum + c->weight / 2;
+
+    if (target < center)
+    {
+      if (center == prev_center)
+        return c->mean;
+      return prev_mean + (c->mean - prev_mean)
+                         * (target - prev_center) / (center - prev_center);
+    }
+    cum += c->weight;
+    prev_center = center;
+    prev_mean = c->mean;
+  }
+
+  /* between the center of the last centroid and the maximum */
+  if (td->count == prev_center)
+    return td->max;
+  return prev_mean + (td->max - prev_mean)
+                     * (target - prev_center) / (td->count - prev_center);
+}
+
+
+/*
+ * Keep the statistics of a finished period, and merge its digest into
+ * the total
+ */
+static void
+close_period(tdigest *td, tdigest *total, int64 key, period_stats **periods,
+             int64 *nperiods, int64 *capacity)
+{
+  period_stats *ps;
+
+  if (td->count == 0)
+    return;
+
+  if (*nperiods == *capacity)
+  {
+    *capacity = Max(*capacity * 2, 64);
+    *periods = (period_stats *) pg_realloc(*periods,
+                                           *capacity * sizeof(period_stats));
+  }
+
+  ps = &(*periods)[(*nperiods)++];
+  ps->key = key;
+  ps->count = td->count;
+  ps->min = td->min;
+  ps->max = td->max;
+  ps->mean = td->sum / td->count;
+  ps->p50 = tdigest_quantile(td, 0.5);
+  ps->p90 = tdigest_quantile(td, 0.9);
+  ps->p99 = tdigest_quantile(td, 0.99);
+
+  if (total)
+    tdigest_merge(total, td);
+  tdigest_init(td);
+}
+
+
+/*
+ * Print the statistics of each period, the last one being the total
+ * when asked for
+ */
+static void
+print_stats(const period_stats *periods, int64 nperiods, bool total)
+{
+  printQueryOpt     myopt;
+  printTableContent cont;
+  int64             i;
+
+  atomic_store(&mem_phase, PHASE_PRINT);
+  init_print_options(&myopt, "Durées");
+  printTableInit(&cont, &myopt.topt, myopt.title, 8, nperiods);
+  printTableAddHeader(&cont, strcmp(opts->stats, "month") == 0
+                      ? "mois" : "semaine", false, 'l');
+  printTableAddHeader(&cont, "pointages", false, 'r');
+  printTableAddHeader(&cont, "min", false, 'l');
+  printTableAddHeader(&cont, "max", false, 'l');
+  printTableAddHeader(&cont, "moyenne", false, 'l');
+  printTableAddHeader(&cont, "p50", false, 'l');
+  printTableAddHeader(&cont, "p90", false, 'l');
+  printTableAddHeader(&cont, "p99", false, 'l');
+  for (i = 0; i < nperiods; i++)
+  {
+    const period_stats *ps = &periods[i];
+
+    printTableAddCell(&cont, total && i == nperiods - 1
+                      ? "total" : format_date(ps->key), false, false);
+    printTableAddCell(&cont, arena_psprintf(&query_arena, INT64_FORMAT,
+                                            ps->count), false, false);
+    printTableAddCell(&cont, format_interval(llround(ps->min), 0, 0), false, false);
+    printTableAddCell(&cont, format_interval(llround(ps->max), 0, 0), false, false);
+    printTableAddCell(&cont, format_interval(llround(ps->mean), 0, 0), false, false);
+    printTableAddCell(&cont, format_interval(llround(ps->p50), 0, 0), false, false);
+    printTableAddCell(&cont, format_interval(llround(ps->p90), 0, 0), false, false);
+    printTableAddCell(&cont, format_interval(llround(ps->p99), 0, 0), false, false);
+  }
+  printTable(&cont, stdout, false, NULL);
+  printTableCleanup(&cont);
+  arena_reset(&query_arena);
+}
+
+
+/*
+ * Duration statistics per week or month from the local replica
+ *
+ * Entries are sorted by deb, so each period is complete when the next
+ * one starts, and only two digests are ever kept.
+ */
+static void
+stats_from_store(const local_store *st, bool monthly)
+{
+  tdigest      *td;
+  tdigest      *total;
+  period_stats *periods = NULL;
+  int64        nperiods = 0;
+  int64        capacity = 0;
+  int64        key = 0;
+  int64        day;
+  int64        i;
+  int          y, m, d;
+
+  td = (tdigest *) pg_malloc(sizeof(tdigest));
+  total = (tdigest *) pg_malloc(sizeof(tdigest));
+  tdigest_init(td);
+  tdigest_init(total);
+
+  for (i = 0; i < st->nrows; i++)
+  {
+    int64 k;
+
+    day = local_day(st->deb[i]);
+    if (monthly)
+    {
+      civil_from_days(day, &y, &m, &d);
+      k = day - (d - 1);
+    }
+    else
+      k = day - ((day + 3) % 7 + 7) % 7;
+
+    if (k != key)
+      close_period(td, total, key, &periods, &nperiods, &capacity);
+    key = k;
+    tdigest_add(td, st->fin[i] - st->deb[i]);
+  }
+  close_period(td, total, key, &periods, &nperiods, &capacity);
+  close_period(total, NULL, 0, &periods, &nperiods, &capacity);
+
+  print_stats(periods, nperiods, nperiods > 0);
+
+  pg_free(periods);
+  pg_free(td);
+  pg_free(total);
+}
+
+
+/*
+ * Report min, max, mean and percentiles of the durations of the entries
+ * per week or month
+ *
+ * By default the server computes them with percentile_cont(), and only
+ * one row per period comes back. With --sketch, the durations are
+ * streamed ordered by deb into a t-digest per period, at constant
+ * memory, and the digests are merged for the total. The periods are
+ * those of deb, in the local time of --tz.
+ */
+void
+stats_report(void)
+{
+  PQExpBufferData sql;
+  PGresult        *res;
+  tdigest         *td;
+  tdigest         *total;
+  period_stats    *periods = NULL;
+  const char      *values[4];
+  const char      *unit = opts->stats;
+  char            count[16];
+  int64           nperiods = 0;
+  int64           capacity = 0;
+  int64           key = PG_INT64_MIN;
+  int             nparams = 0;
+  int             t;
+
+  values[nparams++] = opts->tz ? opts->tz : PQparameterStatus(conn, "TimeZone");
+  if (!values[0])
+    values[0] = "UTC";
+
+  initPQExpBuffer(&sql);
+  if (opts->sketch)
+    appendPQExpBuffer(&sql, "SELECT date_trunc('%s', deb AT TIME ZONE $1)::date, "
+                      "fin - deb", unit);
+  else
+    appendPQExpBuffer(&sql, "SELECT coalesce(date_trunc('%s', deb AT TIME ZONE $1)"
+                      "::date::text, 'total') AS %s, count(*) AS pointages, "
+                      "min(fin - deb) AS min, max(fin - deb) AS max, "
+                      "avg(fin - deb) AS moyenne, "
+                      "percentile_cont(0.5) WITHIN GROUP (ORDER BY fin - deb) AS p50, "
+                      "percentile_cont(0.9) WITHIN GROUP (ORDER BY fin - deb) AS p90, "
+                      "percentile_cont(0.99) WITHIN GROUP (ORDER BY fin - deb) AS p99",
+                      unit, strcmp(unit, "month") == 0 ? "mois" : "semaine");
+  appendPQExpBufferStr(&sql, " FROM public.comptage "
+                       "WHERE deb IS NOT NULL AND fin IS NOT NULL");
+  if (opts->from)
+  {
+    values[nparams++] = opts->from;
+    appendPQExpBuffer(&sql, " AND deb >= $%d::timestamp AT TIME ZONE $1", nparams);
+  }
+  if (opts->to)
+  {
+    values[nparams++] = opts->to;
+    appendPQExpBuffer(&sql, " AND deb < $%d::timestamp AT TIME ZONE $1", nparams);
+  }
+  if (opts->last)
+  {
+    snprintf(count, sizeof(count), "%d", opts->last - 1);
+    values[nparams++] = count;
+    appendPQExpBuffer(&sql, " AND deb >= (date_trunc('%s', now() AT TIME ZONE $1)"
+                      " - $%d::int * interval '1 %s') AT TIME ZONE $1",
+                      unit, nparams, unit);
+  }
+
+  if (!opts->sketch)
+  {
+    /* the empty grouping set gives the total, sorted last */
+    appendPQExpBuffer(&sql, " GROUP BY ROLLUP (date_trunc('%s', deb AT TIME ZONE $1)) "
+                      "ORDER BY date_trunc('%s', deb AT TIME ZONE $1) NULLS LAST",
+                      unit, unit);
+    fetch_table("Durées", sql.data, nparams, values);
+    termPQExpBuffer(&sql);
+    return;
+  }
+
+  appendPQExpBufferStr(&sql, " ORDER BY deb");
+  if (!PQsendQueryParams(conn, sql.data, nparams, NULL, values, NULL, NULL, 1)
+#ifdef LIBPQ_HAS_CHUNK_MODE
+      || (caps.chunked_rows
+          ? !PQsetChunkedRowsMode(conn, CLIENTCOMPTAGE_CHUNK_ROWS)
+          : !PQsetSingleRowMode(conn)))
+#else
+      || !PQsetSingleRowMode(conn))
+#endif
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  td = (tdigest *) pg_malloc(sizeof(tdigest));
+  total = (tdigest *) pg_malloc(sizeof(tdigest));
+  tdigest_init(td);
+  tdigest_init(total);
+
+  while ((res = PQgetResult(conn)) != NULL)
+  {
+    if (!is_row_result(res))
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      pg_log_info("query was: %s", sql.data);
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+
+    for (t = 0; t < PQntuples(res); t++)
+    {
+      const char *v = PQgetvalue(res, t, 1);
+      int64      k = (int32) pg_ntoh32(*(uint32 *) PQgetvalue(res, t, 0))
+                     + POSTGRES_EPOCH_DAYS;
+
+      if (k != key)
+        close_period(td, total, key, &periods, &nperiods, &capacity);
+      key = k;
+
+      /* interval: microseconds, days, months */
+      tdigest_add(td, (int64) pg_ntoh64(*(uint64 *) v)
+                  + (int32) pg_ntoh32(*(uint32 *) (v + 8)) * USECS_PER_DAY
+                  + (int32) pg_ntoh32(*(uint32 *) (v + 12)) * 30 * USECS_PER_DAY);
+    }
+    mem_result(res);
+    PQclear(res);
+  }
+  close_period(td, total, key, &periods, &nperiods, &capacity);
+  close_period(total, NULL, 0, &periods, &nperiods, &capacity);
+
+  print_stats(periods, nperiods, nperiods > 0);
+
+  pg_free(periods);
+  pg_free(td);
+  pg_free(total);
+  termPQExpBuffer(&sql);
+}
+
+
+/*
+ * Add the time of an interval to the weekday × hour cells, split at
+ * each local hour boundary
+ *
+ * cells are indexed by weekday, monday first, then by hour.
+ */
+void
+heatmap_add(int64 deb, int64 fin, int64 cells[7][24])
+{
+  int64 start = deb;
+  int64 secs;
+  int64 local;
+  int64 end;
+  int64 day;
+
+  while (start < fin)
+  {
+    secs = start / USECS_PER_SEC - (start % USECS_PER_SEC < 0);
+    local = secs + utc_offset(secs);
+    day = local / SECS_PER_DAY - (local % SECS_PER_DAY < 0);
+
+    /* next local hour, back in UTC with the offset of the start */
+    end = ((local / SECS_PER_HOUR - (local % SECS_PER_HOUR < 0) + 1)
+           * SECS_PER_HOUR - (local - secs)) * USECS_PER_SEC;
+    end = Min(Max(end, start + 1), fin);
+
+    cells[((day + 3) % 7 + 7) % 7][(local - day * SECS_PER_DAY) / SECS_PER_HOUR]
+      += end - start;
+    start = end;
+  }
+}
+
+
+/*
+ * Draw the weekday × hour cells with Unicode shading
+ *
+ * Each cell gets one of four shades, relative to the busiest cell, and
+ * each line ends with the total of its weekday.
+ */
+static void
+print_heatmap(int64 cells[7][24])
+{
+  static const char *const shades[] = {"  ", "░░", "▒▒", "▓▓", "██"};
+  static const char *const weekdays[] = {
+    "lundi", "mardi", "mercredi", "jeudi", "vendredi", "samedi", "dimanche"
+  };
+  PQExpBufferData out;
+  int64           max = 0;
+  int64           total;
+  int             d;
+  int             h;
+
+  atomic_store(&mem_phase, PHASE_PRINT);
+  for (d = 0; d < 7; d++)
+    for (h = 0; h < 24; h++)
+      max = Max(max, cells[d][h]);
+
+  initPQExpBuffer(&out);
+  appendPQExpBuffer(&out, "%*s\n\n%-9s", 9 + 24, "Carte horaire", "");
+  for (h = 0; h < 24; h++)
+    appendPQExpBuffer(&out, "%02d", h);
+  appendPQExpBufferStr(&out, " total\n");
+
+  for (d = 0; d < 7; d++)
+  {
+    total = 0;
+    appendPQExpBuffer(&out, "%-9s", weekdays[d]);
+    for (h = 0; h < 24; h++)
+    {
+      /* ceil(4 * cell / max): any time at all gets the lightest shade */
+      int level = max ? (int) ((cells[d][h] * 4 + max - 1) / max) : 0;
+
+      appendPQExpBufferStr(&out, shades[level]);
+      total += cells[d][h];
+    }
+    appendPQExpBuffer(&out, " %s\n", format_interval(total, 0, 0));
+  }
+
+  appendPQExpBuffer(&out, "\n%-9s", "");
+  for (d = 1; d < (int) lengthof(shades); d++)
+    appendPQExpBuffer(&out, "%s ≤ %s%s", shades[d],
+                      format_interval((max * d + 3) / 4, 0, 0),
+                      d < (int) lengthof(shades) - 1 ? "  " : "\n");
+
+  fwrite(out.data, 1, out.len, stdout);
+  termPQExpBuffer(&out);
+  arena_reset(&query_arena);
+}
+
+
+/*
+ * Report the time worked per weekday and hour of the day
+ *
+ * The server splits the entries at hour boundaries, in the local time of
+ * --tz, and only sends the 168 cells. --last counts weeks.
+ */
+void
+heatmap_report(void)
+{
+  PQExpBufferData sql;
+  PGresult        *res;
+  const char      *values[4];
+  char            count[16];
+  int64           cells[7][24];
+  int             nparams = 0;
+  int             i;
+
+  values[nparams++] = opts->tz ? opts->tz : PQparameterStatus(conn, "TimeZone");
+  if (!values[0])
+    values[0] = "UTC";
+
+  initPQExpBuffer(&sql);
+  appendPQExpBufferStr(&sql, "SELECT extract(isodow FROM h)::int, "
+                       "extract(hour FROM h)::int, "
+                       "sum(least(f, h + interval '1 hour') - greatest(d, h)) "
+                       "FROM (SELECT deb AT TIME ZONE $1 AS d, fin AT TIME ZONE $1 AS f "
+                       "FROM public.comptage "
+                       "WHERE deb IS NOT NULL AND fin IS NOT NULL AND fin > deb");
+  if (opts->from)
+  {
+    values[nparams++] = opts->from;
+    appendPQExpBuffer(&sql, " AND deb >= $%d::timestamp AT TIME ZONE $1", nparams);
+  }
+  if (opts->to)
+  {
+    values[nparams++] = opts->to;
+    appendPQExpBuffer(&sql, " AND deb < $%d::timestamp AT TIME ZONE $1", nparams);
+  }
+  if (opts->last)
+  {
+    snprintf(count, sizeof(count), "%d", opts->last - 1);
+    values[nparams++] = count;
+    appendPQExpBuffer(&sql, " AND deb >= (date_trunc('week', now() AT TIME ZONE $1)"
+                      " - $%d::int * interval '1 week') AT TIME ZONE $1", nparams);
+  }
+  appendPQExpBufferStr(&sql, ") c, generate_series(date_trunc('hour', d), "
+                       "f - interval '1 microsecond', interval '1 hour') h "
+                       "GROUP BY 1, 2");
+
+  if (opts->script)
+  {
+    printf("\\echo Carte horaire\n");
+    printf("%s;\n", sql.data);
+    termPQExpBuffer(&sql);
+    return;
+  }
+
+  res = run_query(sql.data, nparams, values, 1);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql.data);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  memset(cells, 0, sizeof(cells));
+  for (i = 0; i < PQntuples(res); i++)
+  {
+    const char *v = PQgetvalue(res, i, 2);
+    int        d = (int32) pg_ntoh32(*(uint32 *) PQgetvalue(res, i, 0)) - 1;
+    int        h = (int32) pg_ntoh32(*(uint32 *) PQgetvalue(res, i, 1));
+
+    /* interval: microseconds, days, months */
+    cells[d][h] = (int64) pg_ntoh64(*(uint64 *) v)
+                  + (int32) pg_ntoh32(*(uint32 *) (v + 8)) * USECS_PER_DAY;
+  }
+  PQclear(res);
+
+  print_heatmap(cells);
+  termPQExpBuffer(&sql);
+}
+
+
+/*
+ * Compare the current week with the previous one, or the current month
+ * with the same month of the previous year
+ *
+ * Both periods come from a single scan, restricted to the two ranges on
+ * deb, with one filtered sum per period. The reference period stops at the
+ * same point as the current one, so that a week in progress is not
+ * compared with a whole week.
+ */
+void
+compare_report(void)
+{
+  PQExpBufferData sql;
+  const char      *values[1];
+  bool            monthly = strcmp(opts->compare, "month") == 0;
+  const char      *unit = monthly ? "month" : "week";
+  const char      *step = monthly ? "1 month" : "1 week";
+  const char      *back = monthly ? "1 year" : "1 week";
+
+  values[0] = opts->tz ? opts->tz : PQparameterStatus(conn, "TimeZone");
+  if (!values[0])
+    values[0] = "UTC";
+
+  initPQExpBuffer(&sql);
+  appendPQExpBuffer(&sql, "SELECT periode, reference, total, total_reference, "
+                    "total - total_reference AS ecart, "
+                    "round((100 * (extract(epoch FROM total) "
+                    "/ nullif(extract(epoch FROM total_reference), 0) - 1))::numeric, 1) "
+                    "AS pourcentage "
+                    "FROM (SELECT p.courante::date AS periode, p.precedente::date AS reference, "
+                    "coalesce(sum(c.fin - c.deb) FILTER (WHERE c.deb >= p.courante AT TIME ZONE $1), "
+                    "interval '0') AS total, "
+                    "coalesce(sum(c.fin - c.deb) FILTER (WHERE c.deb < p.courante AT TIME ZONE $1), "
+                    "interval '0') AS total_reference "
+                    "FROM (SELECT courante, precedente, "
+                    "least(precedente + (maintenant - courante), "
+                    "precedente + interval '%s') AS fin_reference "
+                    "FROM (SELECT now() AT TIME ZONE $1 AS maintenant, "
+                    "date_trunc('%s', now() AT TIME ZONE $1) AS courante, "
+                    "date_trunc('%s', now() AT TIME ZONE $1) - interval '%s' AS precedente) n) p "
+                    "LEFT JOIN public.comptage c ON c.fin IS NOT NULL "
+                    "AND ((c.deb >= p.courante AT TIME ZONE $1 AND c.deb < now()) "
+                    "OR (c.deb >= p.precedente AT TIME ZONE $1 "
+                    "AND c.deb < p.fin_reference AT TIME ZONE $1)) "
+                    "GROUP BY p.courante, p.precedente) s",
+                    step, unit, unit, back);
+
+  fetch_table(monthly ? "Mois comparés" : "Semaines comparées",
+              sql.data, 1, values);
+  termPQExpBuffer(&sql);
+}
+
+
+/*
+ * Close the PostgreSQL connection, and quit
+ */
+static void
+quit_properly(SIGNAL_ARGS)
+{
+  PQfinish(conn);
+  exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Main function
+ */
+int
+main(int argc, char **argv)
+{
+  const char *progname;
+  ConnParams cparams;
+  char       sql[CLIENTCOMPTAGE_DEFAULT_STRING_SIZE];
+  char       key[2 * CLIENTCOMPTAGE_KEY_SIZE + 1];
+  int        i;
+
+  /*
+   * If the user stops the program,
+   * quit nicely.
+   */
+  pqsignal(SIGINT, quit_properly);
+
+  /* Initialize the logging interface */
+  pg_logging_init(argv[0]);
+
+  /* Count the allocations from the start, parsing included */
+  for (i = 1; i < argc; i++)
+    if (strcmp(argv[i], "--mem-stats") == 0)
+      mem_stats_enabled = true;
+
+  /* Get the program name */
+  progname = get_progname(argv[0]);
+
+  /* Options live until exit, reports get their memory from query_arena */
+  arena_init(&opts_arena, CLIENTCOMPTAGE_ARENA_BLOCK_SIZE);
+  arena_init(&query_arena, CLIENTCOMPTAGE_ARENA_BLOCK_SIZE);
+
+  /* Allocate the options struct */
+  opts = (struct options *) arena_alloc(&opts_arena, sizeof(struct options));
 
   /* Parse the options */
   get_opts(argc, argv);
 
+  /* Pick the delimiter scanner */
+  init_parser();
+
   /* Set the connection struct */
   cparams.pghost = "localhost";
   cparams.pgport = "5416";
@@ -381,24 +7540,97 @@ main(int argc, char **argv)
   cparams.prompt_password = TRI_DEFAULT;
   cparams.override_dbname = NULL;
 
+  /* Reports from the local replica need no connection */
+  if (opts->offline)
+  {
+    local_report(opts->action);
+    if (opts->verbose)
+      arena_report("query", &query_arena);
+    if (mem_stats_enabled)
+      mem_report();
+    arena_free(&query_arena);
+    arena_free(&opts_arena);
+    return 0;
+  }
+
   /* Connect to the database */
+  atomic_store(&mem_phase, PHASE_CONNECT);
   conn = connectDatabase(&cparams, progname, false, false, false);
+  set_capabilities();
+  set_local_timezone();
+  atomic_store(&mem_phase, PHASE_QUERY);
 
   switch (opts->action)
   {
     case AJOUT:
+      /*
+       * The key is generated once, so that replaying the insert after a
+       * connection loss never adds the same entry twice.
+       */
+      generate_entry_key(key);
       snprintf(sql, sizeof(sql),
-        "INSERT INTO public.comptage (deb,fin) VALUES (%s)", opts->heures);
-      execute(sql);
+        "INSERT INTO public.comptage (deb,fin,cle) VALUES (%s,'%s') "
+        "ON CONFLICT (cle) DO NOTHING", opts->heures, key);
+      add_entry(sql);
       break;
     case JOURS:
-      fetch_table("Jours", "SELECT * FROM public.jours ORDER BY jour DESC LIMIT 10");
+      fetch_table("Jours", "SELECT * FROM public.jours ORDER BY jour DESC LIMIT 10",
+                  0, NULL);
       break;
     case MOIS:
-      fetch_table("Mois", "SELECT * FROM public.mois");
+      /* with a range, filter comptage below the view's aggregation */
+      if (opts->from || opts->to || opts->last || opts->tz)
+      {
+        opts->bucket = "month";
+        bucket_report("public.mois");
+      }
+      else
+        fetch_table("Mois", "SELECT * FROM public.mois", 0, NULL);
       break;
     case SEMAINES:
-      fetch_table("Semaines", "SELECT * FROM public.semaines");
+      if (opts->from || opts->to || opts->last || opts->tz)
+      {
+        opts->bucket = "week";
+        bucket_report("public.semaines");
+      }
+      else
+        fetch_table("Semaines", "SELECT * FROM public.semaines", 0, NULL);
+      break;
+    case BUCKET:
+      bucket_report(NULL);
+      break;
+    case ROLLING:
+      rolling_report();
+      break;
+    case OVERLAPS:
+      merge_overlaps();
+      break;
+    case STATS:
+      stats_report();
+      break;
+    case HEATMAP:
+      heatmap_report();
+      break;
+    case COMPARE:
+      compare_report();
+      break;
+    case INSTALL:
+      install_schema();
+      break;
+    case DAEMON:
+      run_daemon();
+      break;
+    case IMPORT:
+      run_import(&cparams, progname);
+      break;
+    case SYNC:
+      run_sync();
+      break;
+    case FOLLOW:
+      run_follow(&cparams);
+      break;
+    case EXPORT:
+      run_export();
       break;
     default:
       pg_log_error("No action defined");
@@ -406,7 +7638,15 @@ main(int argc, char **argv)
 
   PQfinish(conn);
 
-  pg_free(opts);
+  if (opts->verbose)
+  {
+    arena_report("options", &opts_arena);
+    arena_report("query", &query_arena);
+  }
+  if (mem_stats_enabled)
+    mem_report();
+  arena_free(&query_arena);
+  arena_free(&opts_arena);
 
   return 0;
 }
@@ -0,0 +1,152 @@
+/*-------------------------------------------------------------------------
+ *
+ * bench_parser.c
+ *    Throughput of the import parser of clientcomptage
+ *
+ * Compares the delimiter scanners, and the row parser with a baseline
+ * using sscanf() on each field, over the same generated CSV.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#define main clientcomptage_main
+#include "../clientcomptage.c"
+#undef main
+
+#define BENCH_ROWS 1000000
+
+
+/*
+ * Seconds since an arbitrary point
+ */
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Count the delimiters of the buffer with one scanner
+ */
+static void
+bench_scanner(const char *name,
+              const char *(*scan) (const char *p, const char *end),
+              const char *data, size_t len)
+{
+  const char *p = data;
+  const char *end = data + len;
+  long        found = 0;
+  double      start = now_seconds();
+  double      elapsed;
+
+  while ((p = scan(p, end)) < end)
+  {
+    found++;
+    p++;
+  }
+  elapsed = now_seconds() - start;
+  printf("%-24s %8.1f MB/s  (%ld delimiters)\n", name,
+         len / 1048576.0 / elapsed, found);
+}
+
+
+/*
+ * Parse every row with sscanf(), as a per-field baseline
+ */
+static long
+parse_sscanf(const char *data, size_t len)
+{
+  const char *p = data;
+  const char *end = data + len;
+  const char *eol;
+  char       line[128];
+  struct tm  tm;
+  long       rows = 0;
+  int        y, mo, d, h, mi, s;
+
+  while (p < end)
+  {
+    /* sscanf() measures its input: give it the line only */
+    eol = memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+    memcpy(line, p, Min(eol - p, (long) sizeof(line) - 1));
+    line[Min(eol - p, (long) sizeof(line) - 1)] = '\0';
+
+    if (sscanf(line, "%d-%d-%d %d:%d:%d", &y, &mo, &d, &h, &mi, &s) == 6)
+    {
+      memset(&tm, 0, sizeof(tm));
+      tm.tm_year = y - 1900;
+      tm.tm_mon = mo - 1;
+      tm.tm_mday = d;
+      tm.tm_hour = h;
+      tm.tm_min = mi;
+      tm.tm_sec = s;
+      if (timegm(&tm) != -1)
+        rows++;
+    }
+    p = eol + 1;
+  }
+  return rows;
+}
+
+
+int
+main(int argc, char **argv)
+{
+  PQExpBufferData csv;
+  const char      *p;
+  const char      *eol;
+  const char      *end;
+  double          start;
+  double          elapsed;
+  int64           deb;
+  int64           fin;
+  long            rows = 0;
+  int             i;
+
+  setenv("TZ", "UTC", 1);
+  tzset();
+  init_parser();
+
+  initPQExpBuffer(&csv);
+  for (i = 0; i < BENCH_ROWS; i++)
+    appendPQExpBuffer(&csv, "2024-%02d-%02d %02d:%02d:00+01,"
+                      "2024-%02d-%02d %02d:%02d:30.5+01\n",
+                      i % 12 + 1, i % 28 + 1, i % 10 + 8, i % 60,
+                      i % 12 + 1, i % 28 + 1, i % 10 + 9, i % 60);
+
+  printf("%d rows, %.1f MB\n\n", BENCH_ROWS, csv.len / 1048576.0);
+
+  bench_scanner("scalar scanner", find_delimiter_scalar, csv.data, csv.len);
+#if defined(__x86_64__)
+  bench_scanner("sse2 scanner", find_delimiter_sse2, csv.data, csv.len);
+  if (__builtin_cpu_supports("avx2"))
+    bench_scanner("avx2 scanner", find_delimiter_avx2, csv.data, csv.len);
+#endif
+
+  start = now_seconds();
+  end = csv.data + csv.len;
+  for (p = csv.data; p < end; p = eol + 1)
+  {
+    eol = memchr(p, '\n', end - p);
+    if (parse_row(p, eol, &deb, &fin))
+      rows++;
+  }
+  elapsed = now_seconds() - start;
+  printf("\n%-24s %8.1f ns/row  (%ld rows)\n", "parse_row",
+         elapsed * 1e9 / BENCH_ROWS, rows);
+
+  start = now_seconds();
+  rows = parse_sscanf(csv.data, csv.len);
+  elapsed = now_seconds() - start;
+  printf("%-24s %8.1f ns/row  (%ld rows, first field only)\n",
+         "sscanf baseline", elapsed * 1e9 / BENCH_ROWS, rows);
+
+  termPQExpBuffer(&csv);
+  return 0;
+}
@@ -0,0 +1,161 @@
+/*-------------------------------------------------------------------------
+ *
+ * test_aggregate.c
+ *    Differential test of the client aggregation against the views
+ *
+ * Reads every complete entry of public.comptage, aggregates them with
+ * aggregate_days() and rollup_days() as -o does, and compares the result
+ * with the jours, semaines and mois views of the same database. The
+ * connection string is the first argument, or the PG* environment. The
+ * test is skipped when no database is reachable. Nothing is written.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#define main clientcomptage_main
+#include "../clientcomptage.c"
+#undef main
+
+#define DATEOID 1082
+#define INTERVALOID 1186
+
+
+/*
+ * Compare a view with the client rollup, returns the number of
+ * differences
+ */
+static int
+compare_view(const char *view, const day_buckets *days, actions_t granularity)
+{
+  PQExpBufferData sql;
+  PGresult        *res;
+  int64           *keys;
+  int64           *sums;
+  int64           nkeys;
+  int64           k = 0;
+  int             failures = 0;
+  int             i;
+
+  keys = (int64 *) pg_malloc(Max(days->ndays, 1) * sizeof(int64));
+  sums = (int64 *) pg_malloc(Max(days->ndays, 1) * sizeof(int64));
+  nkeys = rollup_days(days, granularity, keys, sums);
+
+  initPQExpBuffer(&sql);
+  appendPQExpBuffer(&sql, "SELECT * FROM public.%s ORDER BY 1", view);
+  res = PQexecParams(conn, sql.data, 0, NULL, NULL, NULL, NULL, 1);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    fprintf(stderr, "%s: %s", view, PQerrorMessage(conn));
+    exit(EXIT_FAILURE);
+  }
+  if (PQnfields(res) < 2 || PQftype(res, 1) != INTERVALOID)
+  {
+    fprintf(stderr, "%s: the second column is not an interval\n", view);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < PQntuples(res); i++)
+  {
+    const char *v;
+    int64      total;
+
+    /* periods without any time are not kept by the client */
+    if (PQgetisnull(res, i, 1))
+      continue;
+    v = PQgetvalue(res, i, 1);
+    total = (int64) pg_ntoh64(*(uint64 *) v)
+            + (int32) pg_ntoh32(*(uint32 *) (v + 8)) * USECS_PER_DAY
+            + (int32) pg_ntoh32(*(uint32 *) (v + 12)) * 30 * USECS_PER_DAY;
+    if (total == 0)
+      continue;
+
+    if (k >= nkeys)
+    {
+      fprintf(stderr, "%s: row %d missing on the client\n", view, i);
+      failures++;
+      continue;
+    }
+    if (PQftype(res, 0) == DATEOID
+        && (int32) pg_ntoh32(*(uint32 *) PQgetvalue(res, i, 0))
+           + POSTGRES_EPOCH_DAYS != keys[k])
+    {
+      fprintf(stderr, "%s: row %d starts on day " INT64_FORMAT
+              " on the client\n", view, i, keys[k]);
+      failures++;
+    }
+    if (total != sums[k])
+    {
+      fprintf(stderr, "%s: row %d is " INT64_FORMAT " us on the server, "
+              INT64_FORMAT " us on the client\n", view, i, total, sums[k]);
+      failures++;
+    }
+    k++;
+  }
+  if (k != nkeys)
+  {
+    fprintf(stderr, "%s: " INT64_FORMAT " extra rows on the client\n",
+            view, nkeys - k);
+    failures++;
+  }
+
+  printf("%s: %d rows compared, %d differences\n", view, PQntuples(res),
+         failures);
+  PQclear(res);
+  termPQExpBuffer(&sql);
+  pg_free(keys);
+  pg_free(sums);
+  return failures;
+}
+
+
+int
+main(int argc, char **argv)
+{
+  PGresult    *res;
+  day_buckets days;
+  int64       *deb;
+  int64       *fin;
+  int64       n;
+  int64       i;
+  int         failures = 0;
+
+  conn = PQconnectdb(argc > 1 ? argv[1] : "");
+  if (PQstatus(conn) != CONNECTION_OK)
+  {
+    printf("skipped: %s", PQerrorMessage(conn));
+    PQfinish(conn);
+    return EXIT_SUCCESS;
+  }
+  set_local_timezone();
+
+  res = PQexecParams(conn, "SELECT deb, fin FROM public.comptage "
+                     "WHERE deb IS NOT NULL AND fin IS NOT NULL",
+                     0, NULL, NULL, NULL, NULL, 1);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    fprintf(stderr, "%s", PQerrorMessage(conn));
+    return EXIT_FAILURE;
+  }
+  n = PQntuples(res);
+  deb = (int64 *) pg_malloc(Max(n, 1) * sizeof(int64));
+  fin = (int64 *) pg_malloc(Max(n, 1) * sizeof(int64));
+  for (i = 0; i < n; i++)
+  {
+    deb[i] = (int64) pg_ntoh64(*(uint64 *) PQgetvalue(res, i, 0))
+             + POSTGRES_EPOCH_USECS;
+    fin[i] = (int64) pg_ntoh64(*(uint64 *) PQgetvalue(res, i, 1))
+             + POSTGRES_EPOCH_USECS;
+  }
+  PQclear(res);
+
+  aggregate_days(deb, fin, n, &days);
+  failures += compare_view("jours", &days, JOURS);
+  failures += compare_view("semaines", &days, SEMAINES);
+  failures += compare_view("mois", &days, MOIS);
+
+  pg_free(days.totals);
+  pg_free(deb);
+  pg_free(fin);
+  PQfinish(conn);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+/*-------------------------------------------------------------------------
+ *
+ * test_parser.c
+ *    Tests of the import parser of clientcomptage
+ *
+ * The program is built with clientcomptage.c itself, its main() renamed,
+ * so that the static functions can be called directly.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#define main clientcomptage_main
+#include "../clientcomptage.c"
+#undef main
+
+static int failures = 0;
+static int tests = 0;
+
+#define CHECK(cond) \
+  do { \
+    tests++; \
+    if (!(cond)) \
+    { \
+      failures++; \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+
+/*
+ * Parse a whole string as a timestamp
+ */
+static bool
+parse(const char *s, int64 *result)
+{
+  return parse_timestamp(s, s + strlen(s), result);
+}
+
+
+/*
+ * Microseconds since the Unix epoch of a UTC time
+ */
+static int64
+utc(int y, int m, int d, int h, int mi, int sec, int usecs)
+{
+  return (days_from_civil(y, m, d) * SECS_PER_DAY + h * 3600 + mi * 60 + sec)
+         * USECS_PER_SEC + usecs;
+}
+
+
+/*
+ * Timestamps the server accepts give the same instant
+ */
+static void
+test_valid_timestamps(void)
+{
+  int64 t;
+
+  CHECK(parse("2024-03-01 08:30:00Z", &t) && t == utc(2024, 3, 1, 8, 30, 0, 0));
+  CHECK(parse("2024-03-01T08:30Z", &t) && t == utc(2024, 3, 1, 8, 30, 0, 0));
+  CHECK(parse("2024-03-01 08:30:15.25Z", &t)
+        && t == utc(2024, 3, 1, 8, 30, 15, 250000));
+  CHECK(parse("2024-03-01 08:30:00+02", &t) && t == utc(2024, 3, 1, 6, 30, 0, 0));
+  CHECK(parse("2024-03-01 08:30:00-05:30", &t)
+        && t == utc(2024, 3, 1, 14, 0, 0, 0));
+  CHECK(parse("\"2024-03-01 08:30:00\"", &t) && t == utc(2024, 3, 1, 8, 30, 0, 0));
+  CHECK(parse("2024-02-29 12:00:00", &t) && t == utc(2024, 2, 29, 12, 0, 0, 0));
+  CHECK(parse("2000-02-29 12:00:00", &t) && t == utc(2000, 2, 29, 12, 0, 0, 0));
+  CHECK(parse("2024-12-31 23:59:59.999999", &t)
+        && t == utc(2024, 12, 31, 23, 59, 59, 999999));
+  CHECK(parse("2024-03-01 24:00:00", &t) && t == utc(2024, 3, 2, 0, 0, 0, 0));
+  CHECK(parse("2024-03-01 24:00", &t) && t == utc(2024, 3, 2, 0, 0, 0, 0));
+}
+
+
+/*
+ * Timestamps the server refuses are refused here, so that one bad row
+ * cannot fail a whole COPY chunk
+ */
+static void
+test_invalid_timestamps(void)
+{
+  int64 t;
+
+  CHECK(!parse("2024-02-30 08:00:00", &t));
+  CHECK(!parse("2024-02-31 08:00:00", &t));
+  CHECK(!parse("2023-02-29 08:00:00", &t));
+  CHECK(!parse("1900-02-29 08:00:00", &t));
+  CHECK(!parse("2024-04-31 08:00:00", &t));
+  CHECK(!parse("2024-13-01 08:00:00", &t));
+  CHECK(!parse("2024-00-01 08:00:00", &t));
+  CHECK(!parse("2024-01-00 08:00:00", &t));
+  CHECK(!parse("2024-03-01 24:30:00", &t));
+  CHECK(!parse("2024-03-01 24:00:01", &t));
+  CHECK(!parse("2024-03-01 24:00:00.5", &t));
+  CHECK(!parse("2024-03-01 25:00:00", &t));
+  CHECK(!parse("2024-03-01 08:60:00", &t));
+  CHECK(!parse("2024-03-01", &t));
+  CHECK(!parse("2024-03-01 8:30", &t));
+  CHECK(!parse("2024-03-01 08:30:00 UTC", &t));
+  CHECK(!parse("", &t));
+}
+
+
+/*
+ * Rows need exactly two valid fields
+ */
+static void
+test_rows(void)
+{
+  const char *row = "2024-03-01 08:00:00Z,2024-03-01 12:00:00Z";
+  const char *bad = "2024-03-01 08:00:00Z,2024-02-30 12:00:00Z";
+  const char *three = "2024-03-01 08:00:00Z,2024-03-01 12:00:00Z,x";
+  int64      deb;
+  int64      fin;
+
+  CHECK(parse_row(row, row + strlen(row), &deb, &fin)
+        && deb == utc(2024, 3, 1, 8, 0, 0, 0) && fin == utc(2024, 3, 1, 12, 0, 0, 0));
+  CHECK(!parse_row(bad, bad + strlen(bad), &deb, &fin));
+  CHECK(!parse_row(three, three + strlen(three), &deb, &fin));
+}
+
+
+/*
+ * Every delimiter scanner finds the same delimiter, at any alignment
+ */
+static void
+test_delimiters(void)
+{
+  char buf[200];
+  int  len;
+  int  pos;
+
+  for (len = 0; len < 100; len++)
+    for (pos = 0; pos <= len; pos++)
+    {
+      memset(buf, 'x', sizeof(buf));
+      if (pos < len)
+        buf[pos] = pos % 2 ? ',' : '\n';
+      CHECK(find_delimiter_scalar(buf, buf + len) == buf + pos);
+#if defined(__x86_64__)
+      CHECK(find_delimiter_sse2(buf, buf + len) == buf + pos);
+      if (__builtin_cpu_supports("avx2"))
+        CHECK(find_delimiter_avx2(buf, buf + len) == buf + pos);
+#endif
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+  setenv("TZ", "UTC", 1);
+  tzset();
+  init_parser();
+
+  test_valid_timestamps();
+  test_invalid_timestamps();
+  test_rows();
+  test_delimiters();
+
+  printf("%d tests, %d failures\n", tests, failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}